@@ -2,30 +2,81 @@
  * txtedit.c - Simple text editor in C
  */
 
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define TAB_STOP 8
+#define ROW_LEAF_BYTES 4096
+#define ROW_LEAF_SLAB (ROW_LEAF_BYTES * 256) /* leaves are carved from aligned blocks this big */
+#define ROW_NODE_FANOUT 32
+#define MMAP_MIN_SIZE (1 << 20)   /* map files at least this big instead of reading them */
+#define INDEX_CHUNK (64 << 10)    /* bytes of a mapped file indexed per step */
+#define IDLE_INDEX_BYTES (16 << 20)
+#define MAP_BLOCK_BYTES (16 << 20)  /* a big mapped file is kept in memory in blocks this size */
+#define MAP_HOT_BLOCKS 8          /* blocks read last that stay in, the others are dropped */
+#define INDEX_CACHE_MIN_SIZE (64 << 20)  /* files this big get their line index cached */
+#define INDEX_SAMPLES 16          /* blocks hashed to tell the cached file from another */
+#define INDEX_SAMPLE_BYTES 4096
+#define HASH_SEED 14695981039346656037ULL  /* FNV-1a offset basis */
+#define INDEX_BATCH 1024          /* newline offsets collected per scanner call */
+#define READ_CHUNK (1 << 20)
+#define SAVE_BATCH 512            /* rows per writev, two iovecs each */
+#define RENDER_KEEP_SCREENS 2     /* screens above and below the view that keep their render */
+#define ROW_LONG_BYTES (256 << 10)  /* rows this long are indexed in steps instead of rendered whole */
+#define ROW_LONG_STEP 1024        /* chars between two steps of a long row */
 #define QUIT_TIMES 3
+#define AUTOSAVE_SECS 30          /* seconds between swap file writes */
+#define ARENA_SLAB_BYTES (256 << 10)  /* row text is carved out of slabs this big */
+#define ARENA_CLASSES 28          /* size classes, 16 to 4096 bytes */
+#define ARENA_MAX_CLASS 4096
+#define UNDO_MAX_BYTES (8 << 20)  /* undo log size that makes it drop its oldest half */
+#define UNDO_COALESCE_MAX 256     /* longest run of typing merged into one record */
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define APPEND_BUF_INIT {NULL, 0}
-
-#define _BSD_SOURCE
-#define _GNU_SOURCE
+#define APPEND_BUF_INIT {NULL, 0, 0}
+#define APPEND_BUF_MIN 4096
+#define INPUT_BUF_SIZE (64 << 10)
+#define ESC_TIMEOUT_MS 50
+#define FRAME_MIN_MS 8            /* keys arriving sooner than this after a frame wait for the next one */
+#define FRAME_MAX_DEFER_MS 100    /* longest a frame waits for the terminal to send out the last one */
+#define SEARCH_CHUNK_ROWS 16384
+#define SEARCH_MAX_WORKERS 8
+#define PERF_WINDOW 512           /* last frames the overlay takes percentiles over */
+#define TRACE_MAX_FRAMES (1 << 16)  /* frames kept for the trace file, older ones are dropped */
 
 enum EditorKeys {
     BACKSPACE = 127,
-    ARROW_LEFT = 1000,
+    ARROW_LEFT = 0x110000, /* past every Unicode code point */
     ARROW_RIGHT,
     ARROW_UP,
     ARROW_DOWN,
@@ -33,42 +84,444 @@ enum EditorKeys {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY /* a bracketed paste, its text is in E.paste */
+};
+
+enum RowFlags {
+    ROW_MAPPED = 1, /* chars points into the mapped file: not owned, no '\0' */
+    ROW_STALE = 2,  /* render and rsize are out of date */
+    ROW_SHARED = 4, /* chars is referenced by a running save: copy before changing */
+    ROW_LEXED = 8,  /* hl_end was lexed from hl_start and the current text */
+    ROW_HL = 16,    /* the render block ends with a highlight array */
+    ROW_LONG = 32   /* the render block is the steps of a long row */
+};
+
+/* highlight classes of rendered characters */
+enum Highlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
+};
+
+/* lexer states carried from the end of one row to the start of the next */
+enum LexState {
+    LEX_NORMAL = 0,
+    LEX_COMMENT     /* inside a multi-line comment */
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+struct EditorSyntax {
+    char *filetype;
+    char **filematch;      /* extensions, or parts of the file name */
+    char **keywords;       /* keywords ending in '|' are types */
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    int flags;
 };
 
+/* 32 bytes, so a leaf holds a quarter more rows than with int flags and capacity */
 typedef struct EditorRow {
     int size;
     int rsize;
+    int specials; /* characters that are not one byte and one column, -1 if not measured */
+    unsigned char flags;
+    unsigned char cap;      /* arena size class of chars, unused while it is mapped */
+    unsigned char hl_start; /* lexer state the row was lexed from */
+    unsigned char hl_end;   /* lexer state after the row */
     char *chars;
-    char *render;
+    char *render; /* render block, NULL when the row draws as chars */
 } ERow;
 
-struct EditorConfig {
+/*
+* rows live in a B+tree: leaves hold a run of consecutive rows and
+* internal nodes keep the row count of each child, so finding, inserting
+* or deleting a line is O(log n) instead of shifting one big array; they
+* also sum up visual lines, which is what soft wrapping scrolls by
+*/
+struct RowNode;
+
+typedef struct RowLeaf {
+    struct RowNode *parent;
+    struct RowLeaf *prev;
+    struct RowLeaf *next;
+    int count;
+    int lines;    /* visual lines of the rows, count when not wrapping */
+    long long bytes; /* text of the rows, without their newlines */
+    ERow rows[];
+} RowLeaf;
+
+#define ROW_LEAF_CAP ((int)((ROW_LEAF_BYTES - offsetof(RowLeaf, rows)) / sizeof(ERow)))
+
+typedef struct RowNode {
+    struct RowNode *parent;
+    int count;
+    int child_rows[ROW_NODE_FANOUT];
+    int child_lines[ROW_NODE_FANOUT];
+    long long child_bytes[ROW_NODE_FANOUT];
+    void *child[ROW_NODE_FANOUT]; /* RowNode, or RowLeaf on the last level */
+} RowNode;
+
+struct RowTree {
+    void *root; /* a RowLeaf when height is 0 */
+    int height;
+};
+
+typedef struct RowIter {
+    RowLeaf *leaf;
+    int idx;
+} RowIter;
+
+struct AppendBuf {
+  char *buf;
+  int len;
+  int cap;
+};
+
+/* a drawn screen line: len bytes at off in its frame buffer */
+struct ScreenLine {
+    int off;
+    int len;
+};
+
+/*
+* the frame on the terminal is kept so the next one only sends
+* the lines that differ from it
+*/
+struct Screen {
+    struct AppendBuf cur;          /* frame being drawn, lines back to back */
+    struct AppendBuf prev;         /* frame currently on the terminal */
+    struct AppendBuf out;          /* escape sequences sent for a frame */
+    struct AppendBuf span;         /* part of a long row on screen, rendered to draw it */
+    struct ScreenLine *cur_line;
+    struct ScreenLine *prev_line;
+    int lines;                     /* lines drawn into cur so far */
+    int rows;                      /* lines per frame */
+    int valid;                     /* 0 when the terminal contents are unknown */
+    int prev_line_offset;
+    long frame_bytes;              /* bytes written for the last frame */
+    long total_bytes;
+    long frames;
+    long grows;                    /* times any AppendBuf had to be enlarged */
+    long long frame_time;          /* ns on the monotonic clock the last frame was written at */
+};
+
+/* bytes read from the terminal that are not decoded into keys yet */
+struct Input {
+    char buf[INPUT_BUF_SIZE];
+    int start;
+    int end;
+    int fd;     /* the terminal, or a file of keys the bench replays */
+    int key;    /* decoded by input_key_ready but not read yet, or -1 */
+};
+
+/* a slice of the rows a search scans, filled in by one worker */
+struct SearchChunk {
+    int *rows;      /* matching rows, ascending */
+    int count;
+    int done;
+    char **texts;   /* for a replace-all, the rows with every match replaced */
+    int *lens;
+    long matches;
+};
+
+/* state of an incremental search while the prompt is open */
+struct Search {
+    char *query;    /* query the candidate rows are collected for */
+    int qlen;
+    int *rows;      /* ascending indices of the rows containing query */
+    int count;
+    int cap;
+    int complete;   /* rows lists every match, not just a prefix */
+    int match_row;  /* current match, or -1 */
+    int match_col;
+    int active;     /* highlight the visible matches */
+    struct Buffer *buf; /* buffer searched, the rows are read from its tree */
+    int regex;      /* query is an extended regular expression */
+    int compiled;   /* patterns compiled from it, 0 when it is not valid */
+    /* the editor's copy first, then one per worker: glibc locks a pattern while matching */
+    regex_t patterns[SEARCH_MAX_WORKERS + 1];
+    char *with;     /* replacement of a running replace-all, or NULL */
+    int groups;     /* submatches it refers to and the match, asking glibc for more is slower */
+
+    /* the running scan, shared with the workers under lock */
+    pthread_t workers[SEARCH_MAX_WORKERS];
+    int num_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* there are chunks to claim */
+    pthread_cond_t idle;    /* no worker is inside a chunk */
+    int busy;               /* workers scanning a chunk */
+    int cancel;
+    int notified;           /* a wakeup is pending on the wake pipe */
+    int *source;            /* rows to rescan when narrowing, or NULL for all */
+    int source_count;
+    struct SearchChunk *chunks;
+    int num_chunks;
+    int next_chunk;         /* first chunk no worker has claimed */
+    int merged;             /* chunks already appended to rows */
+    int done;               /* chunks finished */
+    int found;              /* matching rows in finished chunks */
+};
+
+/*
+* allocator for row text: blocks come in size classes, four to each power
+* of two, so rounding wastes at most a fifth. Small blocks are carved from
+* big slabs and recycled through a free list per class. Bigger ones go
+* straight to malloc, rounded to the same classes, so a row can keep its
+* capacity in one byte
+*/
+struct Arena {
+    void *free[ARENA_CLASSES];
+    char *slab;          /* rest of the slab blocks are carved from */
+    size_t slab_left;
+    size_t slab_bytes;   /* bytes of all slabs */
+    size_t large_bytes;  /* bytes of blocks bigger than the largest class */
+    size_t used_bytes;   /* capacity of the blocks handed out */
+};
+
+/*
+* row tree leaves, carved from aligned blocks: aligning every leaf on its
+* own costs malloc about one more leaf of padding each
+*/
+struct LeafPool {
+    struct RowLeaf *free; /* freed leaves, linked through next */
+    char *slab;
+    size_t slab_left;
+    size_t slab_bytes;
+};
+
+enum UndoType {
+    UNDO_INSERT,   /* text, possibly with newlines, was inserted at y, x */
+    UNDO_DELETE,   /* text was deleted at y, x */
+    UNDO_ADD_ROW,  /* an empty row y was added after the last row */
+    UNDO_REPLACE   /* the x bytes of row y were replaced by the rest of the text */
+};
+
+/* undone and redone together with the record before it */
+#define UNDO_GROUP 1
+
+/* one edit in the undo log, followed by len bytes of text */
+struct UndoRecord {
+    int prev;            /* size of the record before this one, 0 for the first */
+    int size;            /* bytes taken by this record and its text */
+    unsigned char type;
+    unsigned char flags;
+    int y;
+    int x;
+    int len;
+};
+
+/*
+* undo history: records packed back to back in one growable arena,
+* [0, pos) can be undone and [pos, end) redone
+*/
+struct Undo {
+    char *log;
+    size_t cap;
+    size_t pos;
+    size_t end;
+    int last_size;       /* size of the record ending at pos */
+    size_t group;        /* start of the last group, which trimming keeps */
+    int sealed;          /* the last record takes no more typing */
+    int replaying;       /* edits come from undo or redo, do not record them */
+};
+
+/* a save running on a background thread, from a snapshot of the rows */
+struct SaveJob {
+    struct iovec *rows;  /* text of every row when the save started */
+    int num_rows;
+    char *path;          /* file replaced by the save */
+    int swap;            /* an autosave to the swap file */
+    mode_t mode;         /* permissions the written file gets */
+    int dirty;           /* dirty of the buffer when the snapshot was taken */
+    long long len;       /* bytes written, or -1 on error */
+    int err;
+    double secs;
+    pthread_t thread;
+    int threaded;        /* thread has to be joined */
+    int done;            /* the thread wrote the file, set atomically */
+};
+
+/* start of an index cache file, followed by log_len bytes of line lengths */
+struct IndexCacheHeader {
+    char magic[8];
+    uint64_t size;       /* bytes of the file the key was taken over */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;       /* of blocks sampled from those bytes */
+    uint64_t bytes;      /* bytes of the complete lines the lengths cover */
+    uint64_t log_len;
+    uint64_t log_hash;   /* of the lengths, a damaged cache would split the rows wrong */
+};
+
+enum PerfPhase {
+    PERF_INPUT,     /* decoding keys, not waiting for them */
+    PERF_EDIT,      /* acting on the key */
+    PERF_SCROLL,    /* editor_scroll */
+    PERF_DRAW,      /* drawing rows and bars into the frame */
+    PERF_WRITE,     /* diffing against the last frame and writing it out */
+    PERF_PHASES
+};
+
+/* one recorded frame, from the key (or wakeup) that started it to its write */
+struct PerfFrame {
+    long long start;        /* ns on the monotonic clock */
+    long long ns[PERF_PHASES];
+    int bytes;              /* bytes written to the terminal */
+    int allocs;             /* heap allocations made meanwhile */
+};
+
+struct Perf {
+    int shown;              /* overlay on the message bar, ^T toggles it */
+    char *trace_path;       /* write a Chrome trace of the frames here on exit, or NULL */
+    struct PerfFrame *frames;   /* ring of the last cap frames */
+    int cap;
+    long count;             /* frames recorded so far */
+    int open;               /* frames[count % cap] is being recorded */
+    long long last;         /* end of the last measured phase */
+    long allocs;            /* alloc_count when the frame started */
+    long long summed;       /* when summary was last computed */
+    char summary[96];       /* p50/p99 line the overlay shows */
+};
+
+/*
+* an open file: its rows and everything loading, editing and saving them
+* keeps, shared by every window showing it
+*/
+struct Buffer {
+    int refs;           /* windows showing the buffer */
+    int last_x;         /* cursor when the last window showing it moved on */
+    int last_y;
+    dev_t dev;          /* file the rows came from, to share them when it is opened again */
+    ino_t ino;
+    int wrap_cols;      /* soft wrap rows at this width, 0 when not wrapping */
+    int num_rows;
+    struct RowTree rows;
+    int dirty;
+    char *filename;
+    char *map;          /* read-only mapping of the opened file, or NULL */
+    size_t map_len;
+    size_t map_scan;    /* offset of the first byte not yet split into rows */
+    size_t map_hot[MAP_HOT_BLOCKS]; /* blocks of the mapping read last, most recent first */
+    int map_num_hot;
+    struct timespec map_mtime; /* of the file when it was mapped */
+    struct AppendBuf index_log; /* lengths of the complete mapped lines, scanned or from the index cache */
+    int index_pos;      /* bytes of index_log already made into rows */
+    size_t index_bytes; /* bytes of the mapping index_log covers */
+    size_t index_saved; /* bytes the index cache file covers, for this very file */
+    int load_fd;        /* file still being read in when it is not mapped, or -1 */
+    char *load_buf;     /* text read but not split into rows yet, the unfinished last line */
+    size_t load_len;
+    size_t load_cap;
+    size_t load_read;   /* bytes read from load_fd so far */
+    size_t load_size;   /* size of the file being read, 0 when it is not a regular file */
+    int load_eof;       /* follow mode read up to the end, waiting for the file to grow */
+    int follow;         /* follow mode: read-only, text written to the file is appended */
+    int follow_max;     /* rows follow mode keeps, dropping the oldest, 0 for no limit */
+    int follow_tail;    /* the cursor stays on the last row as rows come in */
+    int follow_partial; /* the last row shows the unfinished line in load_buf */
+    int follow_fd;      /* inotify instance watching the file, or -1 */
+    int follow_wd;      /* watch on the file */
+    int follow_dir_wd;  /* watch on its directory, to see the file replaced by rotation */
+    struct Undo undo;
+    struct SaveJob *save;      /* save in progress, or NULL */
+    int save_again;            /* ^S was pressed while a save was running */
+    struct iovec *orphans;     /* row text freed while a save still used it */
+    int num_orphans;
+    int orphans_cap;
+    int autosave_dirty;        /* dirty at the last write of the swap file */
+    struct EditorSyntax *syntax; /* highlighting for the file type, or NULL */
+    int hl_valid;              /* rows before this one have an up to date hl_end */
+};
+
+/* a view of a buffer: the cursor and the part of the screen showing it */
+struct Window {
+    struct Buffer *buf;
     int cursor_x;
     int cursor_y;
     int rx;
     int row_offset;
     int col_offset;
-    int screen_rows;
+    int cursor_line;    /* visual line of the cursor */
+    int wrap_skip;      /* visual lines of row_offset above the window */
+    int line_offset;    /* visual line at the top of the window */
+    int render_lo;      /* rows of the buffer this window keeps the renders of */
+    int render_hi;
+    int top;            /* screen line of the first text row */
+    int height;         /* text rows, the status bar goes below them */
+};
+
+struct EditorConfig {
+    struct Buffer *buf;        /* buffer of the current window */
+    struct Window *win;        /* window with the cursor */
+    struct Buffer **buffers;   /* every open buffer, shown or not */
+    int num_buffers;
+    struct Window **windows;   /* windows from the top of the screen down */
+    int num_windows;
+    int screen_rows;           /* lines above the message bar, less one for a status bar */
     int screen_cols;
-    int num_rows;
-    ERow *rows;
-    int dirty;
-    char *filename;
     char status_msg[80];
     time_t status_msg_time;
+    int status_msg_shown;      /* the last frame showed the status message */
+    struct Screen screen;
+    struct Input input;
+    struct Search search;
+    int pasting;               /* inside a bracketed paste */
+    struct AppendBuf paste;    /* text of the last bracketed paste */
+    struct Arena arena;
+    struct LeafPool leaves;
+    struct Perf perf;
+    time_t autosave_time;      /* last write of a swap file */
+    int wake_pipe[2];          /* written from the SIGWINCH handler and workers */
     struct termios og_termios; /* original terminal settings */
 };
 
 struct EditorConfig E;
 
-struct AppendBuf {
-  char *buf;
-  int len;
+char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", NULL
+};
+
+/* highlight database */
+struct EditorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
 };
 
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 void set_status_message(const char *fmt, ...);
 void refresh_screen(void);
+void editor_idle(void);
+int editor_has_idle_work(void);
+int rows_read_more(size_t budget);
+void follow_events(void);
+void follow_update(void);
+void editor_resize(void);
+void window_clamp(void);
+void search_collect(void);
+void save_collect(void);
+void editor_save(void);
+void editor_autosave(void);
+int buffer_autosave_due(struct Buffer *b);
+void editor_exit(void);
+void screen_end_line(struct AppendBuf *ab);
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
 
 /* display error message */
@@ -81,540 +534,5205 @@ void display_error(const char *s)
     exit(1);
 }
 
-/* disable raw mode in terminal */
-void disable_raw_mode(void)
+long alloc_count;
+
+#if defined(TXTEDIT_BENCH) && defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/*
+* the benchmarks count heap allocations by sitting in front of glibc's
+* allocator, workers allocate too; the editor itself leaves libc alone
+*/
+#define ALLOC_COUNTING
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size)
 {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.og_termios) == -1) {
-        display_error("tcsetattr");
-    };
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
 }
 
-/* set terminal to raw mode */
-void enable_raw_mode(void)
+void *realloc(void *ptr, size_t size)
 {
-    if (tcgetattr(STDIN_FILENO, &E.og_termios) == -1) {
-        display_error("tcgetattr");
-    };
-    atexit(disable_raw_mode);
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
 
-    struct termios raw = E.og_termios;
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
 
-    /* disable flags */
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag &= ~(CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+void *memalign(size_t alignment, size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
 
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-        display_error("tcsetattr");
-    };
-    
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void *p = memalign(alignment, size);
+    if (p == NULL) return ENOMEM;
+    *ptr = p;
+    return 0;
 }
+#endif
 
 /*
-* read keypresses from user
-* returns: the ASCII code of the keypress
+* make room for len more bytes, doubling the capacity when it runs out
+* returns: 0 on success, -1 if out of memory
 */
-int read_keypress(void)
+int ab_reserve(struct AppendBuf *ab, int len)
 {
-    int nread;
-    char c;
-
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            display_error("read");
-        }
-    };
-
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-            return '\x1b';
-        }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-            return '\x1b';
-        }
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
-                }
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            }
-            else {
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
-            }
-        }
-        else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
-            }
-        }
+    if (ab->len + len <= ab->cap) return 0;
 
-        return '\x1b';
+    int cap = ab->cap ? ab->cap : APPEND_BUF_MIN;
+    while (cap < ab->len + len) {
+        cap *= 2;
     }
-    else {
-        return c;
+    char *new = realloc(ab->buf, cap);
+    if (new == NULL) {
+        return -1;
     }
+    ab->buf = new;
+    ab->cap = cap;
+    E.screen.grows++;
+    return 0;
 }
 
-/*
-* get cursor position
-* returns: 0 on success, -1 on error
-*/
-int get_cursor_pos(int *rows, int *cols)
+/* fill values in append buffer */
+void ab_append(struct AppendBuf *ab,  const char *s, int len)
 {
-    char buf[32];
-    unsigned int i = 0;
+    if (ab_reserve(ab, len) == -1) return;
+    memcpy(&ab->buf[ab->len], s, len);
+    ab->len += len;
+}
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-        return -1;
-    }
+/* append a run of len copies of one character */
+void ab_fill(struct AppendBuf *ab, char c, int len)
+{
+    if (len <= 0 || ab_reserve(ab, len) == -1) return;
+    memset(&ab->buf[ab->len], c, len);
+    ab->len += len;
+}
 
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
-            break;
-        }
-        if (buf[i] == 'R') {
-            break;
-        }
-        i++;
-    }
+/* empty an append buffer but keep its memory for reuse */
+void ab_reset(struct AppendBuf *ab)
+{
+    ab->len = 0;
+}
 
-    buf[i] = '\0';
+/* free append buffer */
+void ab_free(struct AppendBuf *ab)
+{
+    free(ab->buf);
+    ab->buf = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
 
-    if (buf[0] != '\x1b' || buf[1] != '[') {
-        return -1;
-    }
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
-        return -1;
-    }
+/* size class of a block holding n bytes: steps of 16 up to 64, then quarters */
+int arena_class(size_t n)
+{
+    if (n <= 64) return n <= 16 ? 0 : (n - 1) / 16;
+    int b = sizeof(unsigned long) * CHAR_BIT - 1 - __builtin_clzl(n - 1);
+    return 4 + (b - 6) * 4 + ((n - 1) >> (b - 2)) - 4;
+}
 
-    return 0;
+/* bytes in a block of size class k */
+int arena_class_size(int k)
+{
+    if (k < 4) return (k + 1) * 16;
+    int b = 6 + (k - 4) / 4;
+    return (1 << b) + ((k - 4) % 4 + 1) * (1 << (b - 2));
+}
+
+/* capacity of the block text_alloc hands out for n bytes */
+int text_cap(size_t n)
+{
+    return arena_class_size(arena_class(n));
 }
 
 /*
-* get terminal size
-* returns: 0 on success, -1 on error
+* allocate a block for row text of at least n bytes
+* returns: the block, with its capacity in *cap
 */
-int get_window_size(int *rows, int *cols)
+char *text_alloc(size_t n, int *cap)
 {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != -12) {
-            return -1;
-        }
+    struct Arena *a = &E.arena;
+    char *p;
 
-        return get_cursor_pos(rows, cols);
+    int size = text_cap(n);
+    if (n > ARENA_MAX_CLASS) {
+        p = malloc(size);
+        if (p == NULL) display_error("malloc");
+        a->large_bytes += size;
+        a->used_bytes += size;
+        *cap = size;
+        return p;
     }
-    else {
-        *rows = ws.ws_row;
-        *cols = ws.ws_col;
 
-        return 0;
+    int k = arena_class(n);
+    if (a->free[k]) {
+        p = a->free[k];
+        a->free[k] = *(void **)p;
+    }
+    else {
+        if (a->slab_left < (size_t)size) {
+            /* the tail of the old slab is left unused */
+            a->slab = malloc(ARENA_SLAB_BYTES);
+            if (a->slab == NULL) display_error("malloc");
+            a->slab_left = ARENA_SLAB_BYTES;
+            a->slab_bytes += ARENA_SLAB_BYTES;
+        }
+        p = a->slab;
+        a->slab += size;
+        a->slab_left -= size;
     }
+    a->used_bytes += size;
+    *cap = size;
+    return p;
 }
 
-/*
-* convert chars index to render index
-* returns: render index
-*/
-int cx_to_rx(ERow *row, int cx)
+/* give a block of row text back to the arena */
+void text_free(char *p, int cap)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        }
-        rx++;
+    struct Arena *a = &E.arena;
+    if (p == NULL) return;
+    a->used_bytes -= cap;
+    if (cap > ARENA_MAX_CLASS) {
+        a->large_bytes -= cap;
+        free(p);
+        return;
     }
-    return rx;
+    int k = arena_class(cap);
+    *(void **)p = a->free[k];
+    a->free[k] = p;
 }
 
 /*
-* convert render index to chars index
-* returns: chars index
+* make a block of row text hold at least need bytes, keeping its first keep
+* bytes; blocks grow a size class at a time, large ones by half
+* returns: the block, possibly moved, with its new capacity in *cap
 */
-int rx_to_cx(ERow *row, int rx)
+char *text_grow(char *p, int *cap, int keep, size_t need)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-        }
-        cur_rx++;
-    }
-    return cx;
-}
+    if (need <= (size_t)*cap) return p;
 
-/* render tabs as spaces */
-void editor_update_row(ERow *row)
-{
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
+    struct Arena *a = &E.arena;
+    if (*cap > ARENA_MAX_CLASS) {
+        size_t size = text_cap(need + need / 2);
+        char *new = realloc(p, size);
+        if (new == NULL) display_error("realloc");
+        a->large_bytes += size - *cap;
+        a->used_bytes += size - *cap;
+        *cap = size;
+        return new;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
-    
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) {
-                row->render[idx++] = ' ';
-            }
-        }
-        else {
-            row->render[idx++] = row->chars[j];
-        }
-    }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    int new_cap;
+    char *new = text_alloc(need > ARENA_MAX_CLASS ? need + need / 2 : need, &new_cap);
+    memcpy(new, p, keep);
+    text_free(p, *cap);
+    *cap = new_cap;
+    return new;
 }
 
-/* insert lines of text to the editor at a given index */
-void editor_insert_row(int at, char *s, size_t len)
+/* bytes of the block holding the text of a row that is not mapped */
+int row_cap(ERow *row)
 {
-    if (at < 0 || at > E.num_rows) return;
-
-    E.rows = realloc(E.rows, sizeof(ERow) * (E.num_rows + 1));
-    memmove(&E.rows[at + 1], &E.rows[at], sizeof(ERow) * (E.num_rows - at));
-
-    E.rows[at].size = len;
-    E.rows[at].chars = malloc(len + 1);
-    memcpy(E.rows[at].chars, s, len);
-    E.rows[at].chars[len] = '\0';
-
-    E.rows[at].rsize = 0;
-    E.rows[at].render = NULL;
-    editor_update_row(&E.rows[at]);
-
-    E.num_rows++;
-    E.dirty++;
+    return arena_class_size(row->cap);
 }
 
-/* free memory owned by a row */
-void free_row(ERow *row)
+/*
+* allocate a block for the text of a row and note its size class
+* returns: the block
+*/
+char *row_text_alloc(ERow *row, size_t n)
 {
-    free(row->chars);
-    free(row->render);
+    int cap;
+    char *p = text_alloc(n, &cap);
+    row->cap = arena_class(cap);
+    return p;
 }
 
-/* delete a row*/
-void delete_row(int at)
+/* make the text block of a row hold at least need bytes */
+void row_text_grow(ERow *row, size_t need)
 {
-    if (at < 0 || at >= E.num_rows) return;
-    free_row(&E.rows[at]);
-    memmove(&E.rows[at], &E.rows[at + 1], sizeof(ERow) * (E.num_rows - at - 1));
-    E.num_rows--;
-    E.dirty++;
+    int cap = row_cap(row);
+    row->chars = text_grow(row->chars, &cap, row->size + 1, need);
+    row->cap = arena_class(cap);
 }
 
-/* insert a character into a row at a given index */
-void row_insert_char(ERow *row, int at, int c)
+/*
+* check if text is plain ASCII, looking at 32 bytes at a time with SIMD
+* returns: 1 if no byte has the high bit set
+*/
+int is_ascii(const char *s, size_t len)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b))) return 0;
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 32 <= len; i += 32) {
+        uint8x16_t v = vorrq_u8(vld1q_u8((const uint8_t *)(s + i)), vld1q_u8((const uint8_t *)(s + i + 16)));
+        uint8x8_t high = vshrn_n_u16(vreinterpretq_u16_u8(vshrq_n_u8(v, 7)), 4);
+        if (vget_lane_u64(vreinterpret_u64_u8(high), 0)) return 0;
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (w & 0x8080808080808080ULL) return 0;
+    }
+    for (; i < len; i++) {
+        if (s[i] & 0x80) return 0;
+    }
+    return 1;
+}
+
+/*
+* decode the UTF-8 character at the start of s
+* returns: bytes it takes, with the code point in *cp, or -1 there for a
+* byte that does not start a valid character (which then takes one byte)
+*/
+int utf8_decode(const char *s, int len, int *cp)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    int n, c, i;
+    if (p[0] < 0x80) {
+        *cp = p[0];
+        return 1;
+    }
+    else if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        n = 2;
+        c = p[0] & 0x1f;
+    }
+    else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        n = 3;
+        c = p[0] & 0x0f;
+    }
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        n = 4;
+        c = p[0] & 0x07;
+    }
+    else {
+        *cp = -1;
+        return 1;
+    }
+
+    if (n > len) {
+        *cp = -1;
+        return 1;
+    }
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+    /* reject overlong forms, surrogates and anything past U+10FFFF */
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff))
+            || (c >= 0xd800 && c <= 0xdfff)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+/*
+* encode a code point as UTF-8
+* returns: bytes written to buf, at most 4
+*/
+int utf8_encode(int cp, char *buf)
+{
+    if (cp < 0x80) {
+        buf[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        buf[0] = 0xc0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        buf[0] = 0xe0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    buf[0] = 0xf0 | (cp >> 18);
+    buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+    buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+    buf[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* code points that do not take one column, sorted */
+struct WidthRange {
+    int first;
+    int last;
+    int width;
+};
+
+struct WidthRange width_ranges[] = {
+    {0x0300, 0x036f, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05bd, 0}, {0x05bf, 0x05c7, 0},
+    {0x0610, 0x061a, 0}, {0x064b, 0x065f, 0}, {0x0670, 0x0670, 0}, {0x06d6, 0x06ed, 0},
+    {0x0900, 0x0903, 0}, {0x093a, 0x094f, 0}, {0x0951, 0x0957, 0}, {0x0e31, 0x0e31, 0},
+    {0x0e34, 0x0e3a, 0}, {0x0e47, 0x0e4e, 0}, {0x1100, 0x115f, 2}, {0x1ab0, 0x1aff, 0},
+    {0x1dc0, 0x1dff, 0}, {0x200b, 0x200f, 0}, {0x2028, 0x202e, 0}, {0x2060, 0x2064, 0},
+    {0x20d0, 0x20ff, 0}, {0x231a, 0x231b, 2}, {0x2329, 0x232a, 2}, {0x23e9, 0x23ec, 2},
+    {0x23f0, 0x23f3, 2}, {0x25fd, 0x25fe, 2}, {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2},
+    {0x26aa, 0x26ab, 2}, {0x26bd, 0x26be, 2}, {0x26c4, 0x26c5, 2}, {0x26f2, 0x26f5, 2},
+    {0x2705, 0x2705, 2}, {0x270a, 0x270b, 2}, {0x274c, 0x274c, 2}, {0x2753, 0x2755, 2},
+    {0x2795, 0x2797, 2}, {0x2b1b, 0x2b1c, 2}, {0x2e80, 0x303e, 2}, {0x3041, 0x3098, 2},
+    {0x3099, 0x309a, 0}, {0x309b, 0x33ff, 2}, {0x3400, 0x4dbf, 2}, {0x4e00, 0x9fff, 2},
+    {0xa000, 0xa4cf, 2}, {0xa960, 0xa97f, 2}, {0xac00, 0xd7a3, 2}, {0xf900, 0xfaff, 2},
+    {0xfe00, 0xfe0f, 0}, {0xfe10, 0xfe19, 2}, {0xfe20, 0xfe2f, 0}, {0xfe30, 0xfe6f, 2},
+    {0xfeff, 0xfeff, 0}, {0xff00, 0xff60, 2}, {0xffe0, 0xffe6, 2}, {0x16fe0, 0x16fe4, 2},
+    {0x17000, 0x18cff, 2}, {0x1b000, 0x1b2ff, 2}, {0x1f004, 0x1f004, 2}, {0x1f0cf, 0x1f0cf, 2},
+    {0x1f18e, 0x1f18e, 2}, {0x1f191, 0x1f19a, 2}, {0x1f200, 0x1f251, 2}, {0x1f300, 0x1f64f, 2},
+    {0x1f680, 0x1f6ff, 2}, {0x1f7e0, 0x1f7eb, 2}, {0x1f900, 0x1f9ff, 2}, {0x1fa70, 0x1faff, 2},
+    {0x20000, 0x2fffd, 2}, {0x30000, 0x3fffd, 2}, {0xe0001, 0xe007f, 0}, {0xe0100, 0xe01ef, 0},
+};
+
+/*
+* columns a code point takes on the terminal, from a table of combining
+* marks and wide (East Asian and emoji) ranges rather than the locale
+* returns: 0, 1 or 2
+*/
+int char_width(int cp)
+{
+    if (cp < 0x300) return 1;
+    int lo = 0;
+    int hi = sizeof(width_ranges) / sizeof(width_ranges[0]);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (width_ranges[mid].last < cp) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < (int)(sizeof(width_ranges) / sizeof(width_ranges[0])) && width_ranges[lo].first <= cp) {
+        return width_ranges[lo].width;
+    }
+    return 1;
+}
+
+/* frame timings: names of the phases, as the overlay and the trace show them */
+const char *perf_phase_names[PERF_PHASES] = {"input", "edit", "scroll", "draw", "write"};
+
+/* monotonic time in ns */
+long long perf_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* start recording a frame now, forgetting what an open one measured (time spent waiting) */
+void perf_restart(void)
+{
+    struct Perf *pf = &E.perf;
+    if (!pf->shown && !pf->trace_path) return;
+    if (pf->frames == NULL) {
+        pf->cap = pf->trace_path ? TRACE_MAX_FRAMES : PERF_WINDOW;
+        pf->frames = malloc(pf->cap * sizeof(struct PerfFrame));
+        if (pf->frames == NULL) display_error("malloc");
+    }
+    struct PerfFrame *f = &pf->frames[pf->count % pf->cap];
+    memset(f, 0, sizeof(*f));
+    f->start = pf->last = perf_now();
+    pf->allocs = alloc_count;
+    pf->open = 1;
+}
+
+/* charge the time since the last mark to a phase of the open frame */
+void perf_mark(int phase)
+{
+    struct Perf *pf = &E.perf;
+    if (!pf->open) return;
+    long long now = perf_now();
+    pf->frames[pf->count % pf->cap].ns[phase] += now - pf->last;
+    pf->last = now;
+}
+
+/* leave the time since the last mark, spent waiting, out of the open frame */
+void perf_skip(void)
+{
+    if (E.perf.open) {
+        E.perf.last = perf_now();
+    }
+}
+
+int perf_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* redo the overlay line: p50/p99 of every phase over the last PERF_WINDOW frames */
+void perf_summarize(void)
+{
+    struct Perf *pf = &E.perf;
+    int n = pf->count < PERF_WINDOW ? pf->count : PERF_WINDOW;
+    long long v[PERF_WINDOW];
+    long bytes = 0, allocs = 0;
+    int i, k;
+    if (n == 0) return;
+
+    int len = snprintf(pf->summary, sizeof(pf->summary), "p50/p99 us:");
+    for (k = -1; k < PERF_PHASES; k++) {
+        for (i = 0; i < n; i++) {
+            struct PerfFrame *f = &pf->frames[(pf->count - 1 - i) % pf->cap];
+            if (k >= 0) {
+                v[i] = f->ns[k];
+                continue;
+            }
+            int j;
+            v[i] = 0;
+            for (j = 0; j < PERF_PHASES; j++) v[i] += f->ns[j];
+            bytes += f->bytes;
+            allocs += f->allocs;
+        }
+        qsort(v, n, sizeof(long long), perf_cmp);
+        len += snprintf(pf->summary + len, sizeof(pf->summary) - len, " %s %lld/%lld",
+            k < 0 ? "frame" : perf_phase_names[k], v[n / 2] / 1000, v[n * 99 / 100] / 1000);
+        if (len >= (int)sizeof(pf->summary)) return;
+    }
+#ifdef ALLOC_COUNTING
+    snprintf(pf->summary + len, sizeof(pf->summary) - len, " | %ldB %.1f allocs",
+        bytes / n, (double)allocs / n);
+#else
+    (void)allocs;
+    snprintf(pf->summary + len, sizeof(pf->summary) - len, " | %ldB", bytes / n);
+#endif
+}
+
+/* close the open frame, which wrote bytes to the terminal */
+void perf_end_frame(int bytes)
+{
+    struct Perf *pf = &E.perf;
+    if (!pf->open) return;
+    struct PerfFrame *f = &pf->frames[pf->count % pf->cap];
+    f->bytes = bytes;
+    f->allocs = alloc_count - pf->allocs;
+    pf->count++;
+    pf->open = 0;
+
+    /* sorting every frame would show up in what it measures */
+    if (pf->shown && pf->last - pf->summed > 250000000LL) {
+        perf_summarize();
+        pf->summed = pf->last;
+    }
+}
+
+/* write the kept frames as Chrome trace events, one for the frame and one per phase */
+void perf_write_trace(void)
+{
+    struct Perf *pf = &E.perf;
+    if (pf->trace_path == NULL || pf->count == 0) return;
+    FILE *fp = fopen(pf->trace_path, "w");
+    if (fp == NULL) return;
+
+    long first = pf->count > pf->cap ? pf->count - pf->cap : 0;
+    long long epoch = pf->frames[first % pf->cap].start;
+    long i;
+    int k;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = first; i < pf->count; i++) {
+        struct PerfFrame *f = &pf->frames[i % pf->cap];
+        long long t = f->start - epoch;
+        long long total = 0;
+        for (k = 0; k < PERF_PHASES; k++) total += f->ns[k];
+#ifdef ALLOC_COUNTING
+        fprintf(fp, "%s{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"bytes\":%d,\"allocs\":%d}}", i > first ? ",\n" : "", t / 1e3, total / 1e3, f->bytes, f->allocs);
+#else
+        fprintf(fp, "%s{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"bytes\":%d}}", i > first ? ",\n" : "", t / 1e3, total / 1e3, f->bytes);
+#endif
+        for (k = 0; k < PERF_PHASES; k++) {
+            if (f->ns[k]) {
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                    perf_phase_names[k], t / 1e3, f->ns[k] / 1e3);
+            }
+            t += f->ns[k];
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+/* disable raw mode in terminal */
+void disable_raw_mode(void)
+{
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.og_termios) == -1) {
+        display_error("tcsetattr");
+    };
+}
+
+/* set terminal to raw mode */
+void enable_raw_mode(void)
+{
+    if (tcgetattr(STDIN_FILENO, &E.og_termios) == -1) {
+        display_error("tcgetattr");
+    };
+    atexit(disable_raw_mode);
+
+    struct termios raw = E.og_termios;
+
+    /* disable flags */
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag &= ~(CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+
+    /* reads never block, waiting for input is done with poll */
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        display_error("tcsetattr");
+    };
+
+    /* have pasted text marked so it can be inserted as one block */
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/* note a resize ('w') for the event loop, safe to run as a signal handler */
+void handle_sigwinch(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    write(E.wake_pipe[1], "w", 1);
+    errno = saved_errno;
+}
+
+/* set up the pipe that wakes the event loop on resizes and search results */
+void editor_init_signals(void)
+{
+    if (pipe(E.wake_pipe) == -1) {
+        display_error("pipe");
+    }
+    fcntl(E.wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigwinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+        display_error("sigaction");
+    }
+}
+
+/*
+* read all pending input into the input buffer
+* returns: the number of bytes read
+*/
+int input_fill(void)
+{
+    struct Input *in = &E.input;
+    if (in->start > 0) {
+        memmove(in->buf, in->buf + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    if (in->end == INPUT_BUF_SIZE) return 0;
+
+    int nread = read(in->fd, in->buf + in->end, INPUT_BUF_SIZE - in->end);
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        display_error("read");
+    }
+    in->end += nread;
+    return nread;
+}
+
+/*
+* time until the next timer fires
+* returns: milliseconds, or -1 when nothing is scheduled
+*/
+int editor_next_timeout(void)
+{
+    if (editor_has_idle_work()) {
+        return 0;
+    }
+    int timeout = -1;
+    if (E.status_msg_shown) {
+        time_t left = E.status_msg_time + 5 - time(NULL);
+        timeout = left > 0 ? left * 1000 : 0;
+    }
+    int i, due = 0;
+    for (i = 0; i < E.num_buffers; i++) {
+        due |= buffer_autosave_due(E.buffers[i]);
+    }
+    if (due) {
+        time_t left = E.autosave_time + AUTOSAVE_SECS - time(NULL);
+        int ms = left > 0 ? left * 1000 : 0;
+        if (timeout == -1 || ms < timeout) timeout = ms;
+    }
+    return timeout;
+}
+
+/* run whatever timer is due */
+void editor_run_timers(void)
+{
+    if (editor_has_idle_work()) {
+        editor_idle();
+        return;
+    }
+    if (time(NULL) - E.autosave_time >= AUTOSAVE_SECS) {
+        editor_autosave();
+    }
+    if (E.status_msg_shown && time(NULL) - E.status_msg_time >= 5) {
+        refresh_screen();
+    }
+}
+
+/* handle what was written to the wake pipe: resizes, search results and finished saves */
+void editor_wake(void)
+{
+    char buf[64];
+    int resized = 0, searched = 0, saved = 0;
+    int i, len;
+    while ((len = read(E.wake_pipe[0], buf, sizeof(buf))) > 0) {
+        for (i = 0; i < len; i++) {
+            if (buf[i] == 'w') resized = 1;
+            if (buf[i] == 's') searched = 1;
+            if (buf[i] == 'v') saved = 1;
+        }
+    }
+    if (resized) editor_resize();
+    if (searched) search_collect();
+    if (saved) save_collect();
+}
+
+/* block until there is input, handling resizes and timers meanwhile */
+void editor_wait_input(void)
+{
+    while (1) {
+        /*
+        * poll ignores the entries that are -1; rows stay as they are while
+        * a search is open, its workers walk the tree without a lock
+        */
+        int hold = E.search.active;
+        struct pollfd fds[4] = {
+            {E.input.fd, POLLIN, 0},
+            {E.wake_pipe[0], POLLIN, 0},
+            {E.buf->load_eof || hold ? -1 : E.buf->load_fd, POLLIN, 0},
+            {hold ? -1 : E.buf->follow_fd, POLLIN, 0}
+        };
+        int n = poll(fds, 4, editor_next_timeout());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            display_error("poll");
+        }
+        perf_restart();
+
+        if (fds[1].revents & POLLIN) {
+            editor_wake();
+        }
+        if (fds[2].revents) {
+            rows_read_more(IDLE_INDEX_BYTES);
+            if (E.buf->follow) follow_update();
+            refresh_screen();
+        }
+        if (fds[3].revents) {
+            follow_events();
+        }
+        if (fds[0].revents) {
+            if (input_fill() > 0) return;
+            if (fds[0].revents & (POLLHUP | POLLERR)) exit(1);
+            if (E.input.fd != STDIN_FILENO) {
+                fprintf(stderr, "the replayed keys ran out while more were expected\n");
+                exit(1);
+            }
+        }
+        if (n == 0) {
+            editor_run_timers();
+        }
+    }
+}
+
+/*
+* collect bracketed paste text up to the closing marker
+* returns: PASTE_KEY once the paste is complete, -1 if more input is needed
+*/
+int input_parse_paste(void)
+{
+    struct Input *in = &E.input;
+    char *p = in->buf + in->start;
+    int len = in->end - in->start;
+
+    char *end = memmem(p, len, "\x1b[201~", 6);
+    if (end) {
+        ab_append(&E.paste, p, end - p);
+        in->start += end - p + 6;
+        E.pasting = 0;
+        return PASTE_KEY;
+    }
+
+    /* hold back what could be the start of the closing marker */
+    int keep = len < 5 ? len : 5;
+    ab_append(&E.paste, p, len - keep);
+    in->start += len - keep;
+    return -1;
+}
+
+/*
+* decode one key from the front of the input buffer, when complete is
+* set a partial escape sequence is taken as a plain ESC
+* returns: the key, or -1 if more input is needed
+*/
+int input_parse_key(int complete)
+{
+    struct Input *in = &E.input;
+    unsigned char *p = (unsigned char *)in->buf + in->start;
+    int len = in->end - in->start;
+
+    if (E.pasting) return input_parse_paste();
+    if (len == 0) return -1;
+    if (p[0] >= 0x80) {
+        /* a UTF-8 character comes as one key, its code point */
+        int need = p[0] >= 0xf0 ? 4 : p[0] >= 0xe0 ? 3 : p[0] >= 0xc0 ? 2 : 1;
+        if (len < need && !complete) return -1;
+        int cp;
+        in->start += utf8_decode((char *)p, len, &cp);
+        return cp < 0 ? 0xfffd : cp;
+    }
+    if (p[0] != '\x1b') {
+        in->start++;
+        return p[0];
+    }
+    if (len == 1 || (p[1] == 'O' && len == 2)) {
+        if (!complete) return -1;
+        in->start += len;
+        return '\x1b';
+    }
+
+    if (p[1] == '[') {
+        /* CSI: parameter bytes, intermediate bytes, then one final byte */
+        int i = 2;
+        while (i < len && p[i] >= 0x30 && p[i] <= 0x3f) i++;
+        while (i < len && p[i] >= 0x20 && p[i] <= 0x2f) i++;
+        if (i == len) {
+            if (!complete) return -1;
+            in->start += len;
+            return '\x1b';
+        }
+        in->start += i + 1;
+
+        int param = atoi((char *)&p[2]);
+        if (p[i] == '~' && param == 200) {
+            E.pasting = 1;
+            ab_reset(&E.paste);
+            return input_parse_paste();
+        }
+        if (p[i] == '~') {
+            switch (param) {
+                case 1: return HOME_KEY;
+                case 3: return DEL_KEY;
+                case 4: return END_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 7: return HOME_KEY;
+                case 8: return END_KEY;
+            }
+        }
+        else {
+            switch (p[i]) {
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
+                case 'H': return HOME_KEY;
+                case 'F': return END_KEY;
+            }
+        }
+        return '\x1b';
+    }
+    if (p[1] == 'O') {
+        in->start += 3;
+        switch (p[2]) {
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
+        }
+        return '\x1b';
+    }
+
+    in->start++;
+    return '\x1b';
+}
+
+/*
+* read keypresses from user
+* returns: the ASCII code of the keypress
+*/
+int read_keypress(void)
+{
+    int key;
+    /* a key starts a frame, also inside prompts, or follows the edit of the one before */
+    if (!E.perf.open) {
+        perf_restart();
+    }
+    else {
+        perf_mark(PERF_EDIT);
+    }
+    if (E.input.key != -1) {
+        key = E.input.key;
+        E.input.key = -1;
+        perf_mark(PERF_INPUT);
+        return key;
+    }
+    while ((key = input_parse_key(0)) == -1) {
+        if (E.input.end > E.input.start && !E.pasting) {
+            /* a lone ESC or a cut-off sequence: give the rest a moment to arrive */
+            struct pollfd fd = {E.input.fd, POLLIN, 0};
+            if (poll(&fd, 1, ESC_TIMEOUT_MS) > 0 && input_fill() > 0) continue;
+            return input_parse_key(1);
+        }
+        editor_wait_input();
+    }
+    perf_mark(PERF_INPUT);
+    return key;
+}
+
+/*
+* decode the next key if all of it has arrived, reading whatever the
+* terminal has without waiting
+* returns: 1 if read_keypress has a key to return right away, 0 otherwise
+*/
+int input_key_ready(void)
+{
+    if (E.input.key != -1) return 1;
+    if (E.input.start == E.input.end && !E.pasting) {
+        input_fill();
+    }
+    E.input.key = input_parse_key(0);
+    if (E.input.key == -1 && input_fill() > 0) {
+        E.input.key = input_parse_key(0);
+    }
+    return E.input.key != -1;
+}
+
+/*
+* look for ^Q among the keys waiting in the input, decoding them without
+* taking them off it; a paste and the keys after it are left for later
+* returns: 1 if ^Q is waiting
+*/
+int input_quit_waiting(void)
+{
+    struct Input *in = &E.input;
+    if (in->key == CTRL_KEY('q')) return 1;
+    if (E.pasting) return 0;
+
+    int start = in->start;
+    int key, found = 0;
+    while (!found && (in->end - in->start < 6 || memcmp(in->buf + in->start, "\x1b[200~", 6) != 0)
+            && (key = input_parse_key(0)) != -1) {
+        found = key == CTRL_KEY('q');
+    }
+    in->start = start;
+    return found;
+}
+
+/*
+* get cursor position
+* returns: 0 on success, -1 on error
+*/
+int get_cursor_pos(int *rows, int *cols)
+{
+    char buf[32];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+        return -1;
+    }
+
+    while (i < sizeof(buf) - 1) {
+        struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&fd, 1, 1000) != 1 || read(STDIN_FILENO, &buf[i], 1) != 1) {
+            break;
+        }
+        if (buf[i] == 'R') {
+            break;
+        }
+        i++;
+    }
+
+    buf[i] = '\0';
+
+    if (buf[0] != '\x1b' || buf[1] != '[') {
+        return -1;
+    }
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+* get terminal size
+* returns: 0 on success, -1 on error
+*/
+int get_window_size(int *rows, int *cols)
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != -12) {
+            return -1;
+        }
+
+        return get_cursor_pos(rows, cols);
+    }
+    else {
+        *rows = ws.ws_row;
+        *cols = ws.ws_col;
+
+        return 0;
+    }
+}
+
+/* check if a character separates words */
+int is_separator(int c)
+{
+    return isspace((unsigned char)c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/*
+* match a keyword of the current syntax at the start of s
+* returns: length of the keyword, 0 if there is none, with its class in *type
+*/
+int syntax_keyword(const char *s, int len, int *type)
+{
+    char **keywords = E.buf->syntax->keywords;
+    int j;
+    for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) klen--;
+        if (klen <= len && strncmp(s, keywords[j], klen) == 0
+                && (klen == len || is_separator(s[klen]))) {
+            *type = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+            return klen;
+        }
+    }
+    return 0;
+}
+
+/* check if the text at s of len bytes starts with a delimiter */
+int syntax_starts(const char *s, int len, const char *delim, int dlen)
+{
+    return dlen && dlen <= len && memcmp(s, delim, dlen) == 0;
+}
+
+/*
+* lex a line of text starting in a given lexer state, filling hl with the
+* class of every byte unless it is NULL; without hl only what carries
+* over to the next line (comments and strings) is looked at
+* returns: lexer state at the end of the line
+*/
+int syntax_lex(const char *s, int len, int state, unsigned char *hl)
+{
+    struct EditorSyntax *syn = E.buf->syntax;
+    char *scs = syn->singleline_comment_start;
+    char *mcs = syn->multiline_comment_start;
+    char *mce = syn->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int prev = HL_NORMAL;
+    int in_string = 0;
+    int in_comment = state == LEX_COMMENT;
+    int i = 0;
+    while (i < len) {
+        char c = s[i];
+        int type = HL_NORMAL;
+        int n = 1;
+
+        if (in_comment) {
+            /* the whole comment up to its end is one span */
+            char *end = mce_len ? memmem(&s[i], len - i, mce, mce_len) : NULL;
+            type = HL_MLCOMMENT;
+            n = len - i;
+            if (end) {
+                n = end - &s[i] + mce_len;
+                in_comment = 0;
+                prev_sep = 1;
+            }
+        }
+        else if (in_string) {
+            type = HL_STRING;
+            if (c == '\\' && i + 1 < len) n = 2;
+            else if (c == in_string) in_string = 0;
+            prev_sep = 1;
+        }
+        else if (syntax_starts(&s[i], len - i, scs, scs_len)) {
+            type = HL_COMMENT;
+            n = len - i;
+        }
+        else if (syntax_starts(&s[i], len - i, mcs, mcs_len)) {
+            type = HL_MLCOMMENT;
+            n = mcs_len;
+            in_comment = 1;
+        }
+        else if ((syn->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+            type = HL_STRING;
+            in_string = c;
+            prev_sep = 1;
+        }
+        else if (hl == NULL) {
+            /* words and numbers never reach the next line, skip to what may start a comment or string */
+            while (i + n < len && s[i + n] != '"' && s[i + n] != '\''
+                    && (!scs_len || s[i + n] != scs[0]) && (!mcs_len || s[i + n] != mcs[0])) {
+                n++;
+            }
+        }
+        else if ((syn->flags & HL_HIGHLIGHT_NUMBERS)
+                && ((isdigit((unsigned char)c) && (prev_sep || prev == HL_NUMBER)) || (c == '.' && prev == HL_NUMBER))) {
+            type = HL_NUMBER;
+            prev_sep = 0;
+        }
+        else if (prev_sep && (n = syntax_keyword(&s[i], len - i, &type)) > 0) {
+            prev_sep = 0;
+        }
+        else {
+            n = 1;
+            prev_sep = is_separator(c);
+        }
+
+        if (hl) memset(&hl[i], type, n);
+        prev = type;
+        i += n;
+    }
+    return in_comment ? LEX_COMMENT : LEX_NORMAL;
+}
+
+/*
+* map a highlight class to a terminal color
+* returns: SGR foreground color
+*/
+int syntax_to_color(int hl)
+{
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        default: return 39;
+    }
+}
+
+/*
+* a row's render block starts with a map of its specials, the characters
+* that do not take one byte and one column: tabs, non-ASCII characters
+* and characters followed by combining marks, each with the marks. For
+* every special the map has its chars index and, just past it, the chars
+* index, screen column and render index; everything between two specials
+* is plain ASCII, so any position converts with a binary search and an
+* offset. The rendered text follows the map and, while highlighting, the
+* highlight of each render byte follows the text
+*/
+struct RenderMap {
+    int count;
+    int bytes;    /* length of the rendered text */
+    int *pos;
+    int *end;
+    int *rx;
+    int *rb;
+};
+
+/* a character start in a row: its chars index, screen column and render index */
+struct RowStep {
+    int cx;
+    int rx;
+    int rb;
+};
+
+/*
+* a row of ROW_LONG_BYTES or more is not rendered whole: its render block
+* holds a step about every ROW_LONG_STEP chars, the first at the start and
+* the last at the end of the row. Any position is found by stepping over
+* the characters from the step before it, and drawing renders only what
+* is on screen
+*/
+struct RowSteps {
+    int count;
+    int cap;
+    struct RowStep step[];
+};
+
+/* find the map of a row, an empty one when the row has no render block */
+void row_map(ERow *row, struct RenderMap *m)
+{
+    int *map = (int *)row->render;
+    if (map == NULL) {
+        m->count = 0;
+        m->bytes = row->size;
+        m->pos = m->end = m->rx = m->rb = NULL;
+        return;
+    }
+    m->count = map[0];
+    m->bytes = map[1];
+    m->pos = map + 2;
+    m->end = m->pos + m->count;
+    m->rx = m->end + m->count;
+    m->rb = m->rx + m->count;
+}
+
+/*
+* get the rendered text of a row's block
+* returns: the text, NUL terminated
+*/
+char *row_render_text(ERow *row)
+{
+    int *map = (int *)row->render;
+    return (char *)(map + 2 + 4 * map[0]);
+}
+
+/*
+* get the highlight of each render byte of a row
+* returns: one class per render byte, or NULL when the row is not highlighted
+*/
+unsigned char *row_hl(ERow *row)
+{
+    if (!(row->flags & ROW_HL)) return NULL;
+    int *map = (int *)row->render;
+    return (unsigned char *)row_render_text(row) + map[1] + 1;
+}
+
+/* bytes of a render block with a map of count specials, bytes of text and maybe a highlight */
+size_t render_block_size(int count, int bytes, int hl)
+{
+    return sizeof(int) * (2 + 4 * count) + bytes + 1 + (hl ? bytes : 0);
+}
+
+/* bytes of a render block with room for cap steps of a long row */
+size_t steps_block_size(int cap)
+{
+    return offsetof(struct RowSteps, step) + sizeof(struct RowStep) * cap;
+}
+
+/*
+* size the render block of a row was allocated for
+* returns: bytes of the block
+*/
+size_t row_render_size(ERow *row)
+{
+    if (row->flags & ROW_LONG) return steps_block_size(((struct RowSteps *)row->render)->cap);
+    int *map = (int *)row->render;
+    return render_block_size(map[0], map[1], row->flags & ROW_HL);
+}
+
+/* release the render of a row that is far away from the screen */
+void row_drop_render(ERow *row)
+{
+    if (row->render) {
+        text_free(row->render, text_cap(row_render_size(row)));
+        row->render = NULL;
+        row->flags |= ROW_STALE;
+        row->flags &= ~(ROW_HL | ROW_LONG);
+    }
+}
+
+/*
+* step over the character of a row at p with the combining marks after
+* it, rendering it to out when set
+* returns: 1 if it is a special
+*/
+int row_step(const char *s, int size, struct RowStep *p, char *out)
+{
+    int i = p->cx;
+    int cp;
+    int len = utf8_decode(&s[i], size - i, &cp);
+    int w, rlen, special = 1;
+    if (cp == '\t') {
+        w = TAB_STOP - p->rx % TAB_STOP;
+        rlen = w;
+        if (out) memset(out, ' ', w);
+    }
+    else if (cp < 0) {
+        /* show bytes that are not UTF-8 as U+FFFD */
+        w = 1;
+        rlen = 3;
+        if (out) memcpy(out, "\xef\xbf\xbd", 3);
+    }
+    else {
+        w = char_width(cp);
+        rlen = len;
+        special = cp >= 0x80;
+        if (out) memcpy(out, &s[i], len);
+    }
+
+    /* combining marks belong to the character before them */
+    int end = i + len;
+    while (end < size && (s[end] & 0x80)) {
+        int mark;
+        int mlen = utf8_decode(&s[end], size - end, &mark);
+        if (mark < 0 || char_width(mark) != 0) break;
+        if (out) memcpy(&out[rlen], &s[end], mlen);
+        rlen += mlen;
+        end += mlen;
+        special = 1;
+    }
+
+    p->cx = end;
+    p->rx += w;
+    p->rb += rlen;
+    return special;
+}
+
+/*
+* walk the characters of a row, measuring its width in columns and the
+* length of its render; the map and text are filled in when out is set
+* returns: number of specials
+*/
+int row_scan(ERow *row, int *width, int *bytes, struct RenderMap *m, char *out)
+{
+    const char *s = row->chars;
+    int size = row->size;
+    int n = 0;
+
+    if (is_ascii(s, size)) {
+        /* only tabs are special, skip between them with memchr */
+        const char *p = s;
+        const char *tab;
+        int rx = 0;
+        while ((tab = memchr(p, '\t', s + size - p)) != NULL) {
+            if (out) memcpy(&out[rx], p, tab - p);
+            rx += tab - p;
+            int w = TAB_STOP - rx % TAB_STOP;
+            if (out) {
+                memset(&out[rx], ' ', w);
+                m->pos[n] = tab - s;
+                m->end[n] = tab - s + 1;
+                m->rx[n] = rx + w;
+                m->rb[n] = rx + w;
+            }
+            rx += w;
+            n++;
+            p = tab + 1;
+        }
+        if (out) memcpy(&out[rx], p, s + size - p);
+        *width = *bytes = rx + (s + size - p);
+        return n;
+    }
+
+    struct RowStep p = {0, 0, 0};
+    while (p.cx < size) {
+        int i = p.cx;
+        int special = row_step(s, size, &p, out ? &out[p.rb] : NULL);
+        if (special && out) {
+            m->pos[n] = i;
+            m->end[n] = p.cx;
+            m->rx[n] = p.rx;
+            m->rb[n] = p.rb;
+        }
+        n += special;
+    }
+    *width = p.rx;
+    *bytes = p.rb;
+    return n;
+}
+
+/*
+* allocate a render block for up to cap steps of a long row
+* returns: the block, holding no steps yet
+*/
+struct RowSteps *steps_alloc(int cap)
+{
+    int size;
+    struct RowSteps *st = (struct RowSteps *)text_alloc(steps_block_size(cap), &size);
+    st->count = 0;
+    st->cap = cap;
+    return st;
+}
+
+/* a chars index (key 0), screen column (key 1) or render index (key 2) of a step */
+int step_key(struct RowStep *p, int key)
+{
+    return key == 0 ? p->cx : key == 1 ? p->rx : p->rb;
+}
+
+/*
+* find the last step at or before a position by one of its keys
+* returns: index of the step, the first one when none is
+*/
+int steps_find(struct RowSteps *st, int key, int value)
+{
+    int lo = 0, hi = st->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (step_key(&st->step[mid], key) <= value) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? lo - 1 : 0;
+}
+
+/* step over a long row from p up to chars index to, adding a step every ROW_LONG_STEP chars */
+void steps_scan(ERow *row, struct RowSteps *st, struct RowStep *p, int to)
+{
+    while (p->cx < to) {
+        if (p->cx >= st->step[st->count - 1].cx + ROW_LONG_STEP) st->step[st->count++] = *p;
+        row_step(row->chars, row->size, p, NULL);
+    }
+}
+
+/* index a long row by stepping over all of it, it must have no render */
+void row_long_index(ERow *row)
+{
+    struct RowSteps *st = steps_alloc(row->size / ROW_LONG_STEP + 2);
+    struct RowStep p = {0, 0, 0};
+    st->step[st->count++] = p;
+    steps_scan(row, st, &p, row->size);
+    st->step[st->count++] = p;
+    row->render = (char *)st;
+    row->flags |= ROW_LONG;
+    row->rsize = p.rx;
+}
+
+/*
+* bring the steps of a long row up to date after ins bytes at at replaced
+* del bytes of its text: the steps before the edit stay, and the text
+* after it is stepped over only until it lines up with an old step, the
+* ones from there on move by as much as it did. A move that is not a whole
+* tab stop only holds up to the next tab, past it the columns line up again
+*/
+void row_long_edit(ERow *row, int at, int del, int ins)
+{
+    struct RowSteps *old = (struct RowSteps *)row->render;
+    struct RowStep *o = old->step;
+    int n = old->count;
+    int dcx = ins - del;
+    struct RowSteps *st = steps_alloc(n + row->size / ROW_LONG_STEP + 1);
+
+    /* the character before a step is only over if no mark follows, so keep clear of the edit */
+    int k = steps_find(old, 0, at - 5);
+    memcpy(st->step, o, sizeof(struct RowStep) * (k + 1));
+    st->count = k + 1;
+    struct RowStep p = o[k];
+    int j = k + 1;
+    while (o[j].cx < at + del) j++;
+
+    for (;;) {
+        steps_scan(row, st, &p, o[j].cx + dcx);
+        if (p.cx > o[j].cx + dcx) {
+            /* the old step is inside a character now */
+            j++;
+            continue;
+        }
+        int drx = p.rx - o[j].rx;
+        int drb = p.rb - o[j].rb;
+        int last = n;
+        if (drx % TAB_STOP) {
+            char *tab = memchr(&row->chars[p.cx], '\t', row->size - p.cx);
+            if (tab) {
+                last = j;
+                while (o[last].cx + dcx <= tab - row->chars) last++;
+            }
+        }
+        for (; j < last; j++) {
+            struct RowStep q = {o[j].cx + dcx, o[j].rx + drx, o[j].rb + drb};
+            st->step[st->count++] = q;
+        }
+        if (last == n) break;
+        p = st->step[st->count - 1];
+    }
+
+    text_free(row->render, text_cap(row_render_size(row)));
+    row->render = (char *)st;
+    row->rsize = st->step[st->count - 1].rx;
+}
+
+/*
+* find the character of a long row holding a chars index (key 0), a
+* screen column (key 1) or a render index (key 2), stepping over the
+* characters from the step before it
+* returns: the start of the character, and the start of the next one in *next
+*/
+struct RowStep row_long_seek(ERow *row, int key, int value, struct RowStep *next)
+{
+    struct RowSteps *st = (struct RowSteps *)row->render;
+    struct RowStep p = st->step[steps_find(st, key, value)];
+    struct RowStep q = p;
+    while (p.cx < row->size) {
+        q = p;
+        row_step(row->chars, row->size, &q, NULL);
+        if (step_key(&q, key) > value) break;
+        p = q;
+    }
+    *next = q;
+    return p;
+}
+
+/*
+* render the characters of a long row from the one holding render index
+* from until render index to into ab
+* returns: the text, starting at the byte of render index from
+*/
+char *row_render_span(ERow *row, int from, int to, struct AppendBuf *ab)
+{
+    struct RowStep next, p = row_long_seek(row, 2, from, &next);
+    int start = p.rb;
+    ab_reset(ab);
+    ab_reserve(ab, 1);
+    while (p.rb < to && p.cx < row->size) {
+        struct RowStep q = p;
+        row_step(row->chars, row->size, &q, NULL);
+        if (ab_reserve(ab, q.rb - p.rb) == -1) break;
+        row_step(row->chars, row->size, &p, &ab->buf[ab->len]);
+        ab->len = p.rb - start;
+    }
+    return &ab->buf[from - start];
+}
+
+/* set rsize to the width of a row without rendering it, it must have no render */
+void row_measure(ERow *row)
+{
+    int bytes;
+    row->specials = row_scan(row, &row->rsize, &bytes, NULL, NULL);
+}
+
+/* render tabs as spaces and non-ASCII text as what the terminal shows, indexing the specials */
+void editor_update_row(ERow *row)
+{
+    row_drop_render(row);
+    row->flags &= ~ROW_STALE;
+    if (row->size >= ROW_LONG_BYTES) {
+        /* indexed instead, and drawn without highlighting */
+        row_long_index(row);
+        return;
+    }
+
+    /* measure first: the block is sized exactly so its class follows from it */
+    int bytes;
+    row->specials = row_scan(row, &row->rsize, &bytes, NULL, NULL);
+    if (row->specials == 0 && E.buf->syntax == NULL) {
+        /* nothing to expand, the row is drawn straight from chars */
+        return;
+    }
+
+    int cap;
+    row->render = text_alloc(render_block_size(row->specials, bytes, E.buf->syntax != NULL), &cap);
+    int *map = (int *)row->render;
+    map[0] = row->specials;
+    map[1] = bytes;
+    struct RenderMap m;
+    row_map(row, &m);
+    char *text = row_render_text(row);
+    row_scan(row, &row->rsize, &bytes, &m, text);
+    text[bytes] = '\0';
+
+    if (E.buf->syntax) {
+        /* tabs lex like the spaces they render as, hl_end is the same as from chars */
+        row->flags |= ROW_HL | ROW_LEXED;
+        row->hl_end = syntax_lex(text, bytes, row->hl_start, row_hl(row));
+    }
+}
+
+/*
+* visual lines of a row: while wrapping, rsize is kept up to date as the
+* width of every row
+* returns: number of screen lines the row takes
+*/
+int row_lines(ERow *row)
+{
+    if (E.buf->wrap_cols == 0 || row->rsize == 0) return 1;
+    return (row->rsize + E.buf->wrap_cols - 1) / E.buf->wrap_cols;
+}
+
+/*
+* find the visual line of a wrapped row a render index is on, the end of
+* a row that fills its last line stays on that line
+* returns: line inside the row
+*/
+int row_sub_line(ERow *row, int rx)
+{
+    int sub = rx / E.buf->wrap_cols;
+    int lines = row_lines(row);
+    return sub < lines ? sub : lines - 1;
+}
+
+/*
+* get the text of a row as it is drawn, rendering it first if stale
+* returns: the rendered text, or NULL for a long row, see row_render_span
+*/
+char *row_render(ERow *row)
+{
+    if (row->flags & ROW_STALE) {
+        editor_update_row(row);
+    }
+    if (row->flags & ROW_LONG) return NULL;
+    return row->render ? row_render_text(row) : row->chars;
+}
+
+/*
+* count the specials that end at or before a position, in one of the
+* sorted position arrays of a map
+* returns: number of such specials
+*/
+int map_find(int *after, int count, int at)
+{
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (after[mid] <= at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+* convert chars index to screen column (rb 0) or render index (rb 1), a
+* chars index inside a special gives its start
+* returns: the converted index
+*/
+int cx_convert(ERow *row, int cx, int rb)
+{
+    row_render(row);
+    if (row->flags & ROW_LONG) {
+        struct RowStep next, p = row_long_seek(row, 0, cx, &next);
+        return rb ? p.rb : p.rx;
+    }
+    struct RenderMap m;
+    row_map(row, &m);
+    int k = map_find(m.end, m.count, cx);
+    int base_cx = k ? m.end[k - 1] : 0;
+    int base = k ? (rb ? m.rb : m.rx)[k - 1] : 0;
+    if (k < m.count && cx > m.pos[k]) cx = m.pos[k];
+    return base + (cx - base_cx);
+}
+
+/*
+* convert chars index to screen column
+* returns: column
+*/
+int cx_to_rx(ERow *row, int cx)
+{
+    return cx_convert(row, cx, 0);
+}
+
+/*
+* convert chars index to render index
+* returns: render index
+*/
+int cx_to_rb(ERow *row, int cx)
+{
+    return cx_convert(row, cx, 1);
+}
+
+/*
+* convert screen column to chars index, a column inside a tab or wide
+* character gives that character
+* returns: chars index
+*/
+int rx_to_cx(ERow *row, int rx)
+{
+    row_render(row);
+    if (row->flags & ROW_LONG) {
+        struct RowStep next;
+        return row_long_seek(row, 1, rx, &next).cx;
+    }
+    struct RenderMap m;
+    row_map(row, &m);
+    int k = map_find(m.rx, m.count, rx);
+    int base_cx = k ? m.end[k - 1] : 0;
+    int base_rx = k ? m.rx[k - 1] : 0;
+    int gap = (k < m.count ? m.pos[k] : row->size) - base_cx;
+    int off = rx - base_rx;
+    return base_cx + (off < gap ? off : gap);
+}
+
+/*
+* find the render byte drawn at a screen column, a column inside a wide
+* character gives the start of that character
+* returns: render index, with the column it is drawn at in *col
+*/
+int rx_to_rb(ERow *row, int rx, int *col)
+{
+    row_render(row);
+    if (row->flags & ROW_LONG) {
+        struct RowStep next, p = row_long_seek(row, 1, rx, &next);
+        if (p.cx < row->size && row->chars[p.cx] == '\t') {
+            /* tabs are spaces */
+            *col = rx;
+            return p.rb + (rx - p.rx);
+        }
+        *col = p.rx;
+        return p.rb;
+    }
+    struct RenderMap m;
+    row_map(row, &m);
+    int k = map_find(m.rx, m.count, rx);
+    int base_cx = k ? m.end[k - 1] : 0;
+    int base_rx = k ? m.rx[k - 1] : 0;
+    int base_rb = k ? m.rb[k - 1] : 0;
+    int gap = (k < m.count ? m.pos[k] : row->size) - base_cx;
+    int off = rx - base_rx;
+    if (off > gap) {
+        /* inside the next special: tabs are spaces, anything else starts over */
+        if (k < m.count && row->chars[m.pos[k]] == '\t') {
+            int w = m.rx[k] - (base_rx + gap);
+            if (off - gap < w) gap = off;
+        }
+        off = gap;
+    }
+    *col = base_rx + off;
+    return base_rb + off;
+}
+
+/*
+* step over one character with its combining marks
+* returns: chars index of the next character
+*/
+int row_next_char(ERow *row, int cx)
+{
+    if (cx >= row->size) return row->size;
+    row_render(row);
+    if (row->flags & ROW_LONG) {
+        struct RowStep next;
+        row_long_seek(row, 0, cx, &next);
+        return next.cx;
+    }
+    struct RenderMap m;
+    row_map(row, &m);
+    int k = map_find(m.end, m.count, cx);
+    if (k < m.count && m.pos[k] <= cx) return m.end[k];
+    return cx + 1;
+}
+
+/*
+* step back over one character with its combining marks
+* returns: chars index of the previous character
+*/
+int row_prev_char(ERow *row, int cx)
+{
+    if (cx <= 0) return 0;
+    row_render(row);
+    if (row->flags & ROW_LONG) {
+        struct RowStep next;
+        return row_long_seek(row, 0, cx - 1, &next).cx;
+    }
+    struct RenderMap m;
+    row_map(row, &m);
+    int k = map_find(m.end, m.count, cx - 1);
+    if (k < m.count && m.pos[k] < cx) return m.pos[k];
+    return cx - 1;
+}
+
+/* leaves and nodes both start with their parent pointer */
+#define TREE_PARENT(n) (*(RowNode **)(n))
+
+/* allocate an empty leaf, aligned to its size so a row can find its leaf */
+RowLeaf *leaf_new(void)
+{
+    struct LeafPool *p = &E.leaves;
+    RowLeaf *leaf = p->free;
+    if (leaf) {
+        p->free = leaf->next;
+    }
+    else {
+        if (p->slab_left == 0) {
+            p->slab = aligned_alloc(ROW_LEAF_BYTES, ROW_LEAF_SLAB);
+            if (p->slab == NULL) display_error("aligned_alloc");
+            p->slab_left = ROW_LEAF_SLAB;
+            p->slab_bytes += ROW_LEAF_SLAB;
+        }
+        leaf = (RowLeaf *)p->slab;
+        p->slab += ROW_LEAF_BYTES;
+        p->slab_left -= ROW_LEAF_BYTES;
+    }
+    leaf->parent = NULL;
+    leaf->prev = NULL;
+    leaf->next = NULL;
+    leaf->count = 0;
+    leaf->lines = 0;
+    leaf->bytes = 0;
+    return leaf;
+}
+
+/* give a leaf back to the pool */
+void leaf_free(RowLeaf *leaf)
+{
+    leaf->next = E.leaves.free;
+    E.leaves.free = leaf;
+}
+
+/* get the leaf a row is stored in */
+RowLeaf *row_leaf(ERow *row)
+{
+    return (RowLeaf *)((uintptr_t)row & ~(uintptr_t)(ROW_LEAF_BYTES - 1));
+}
+
+/* recount the visual lines of the rows in a leaf */
+int leaf_lines(RowLeaf *leaf)
+{
+    int lines = 0;
+    int i;
+    for (i = 0; i < leaf->count; i++) {
+        lines += row_lines(&leaf->rows[i]);
+    }
+    return lines;
+}
+
+/* recount the text bytes of the rows in a leaf */
+long long leaf_bytes(RowLeaf *leaf)
+{
+    long long bytes = 0;
+    int i;
+    for (i = 0; i < leaf->count; i++) {
+        bytes += leaf->rows[i].size;
+    }
+    return bytes;
+}
+
+/* total rows below an internal node */
+int node_rows(RowNode *node)
+{
+    int rows = 0;
+    int i;
+    for (i = 0; i < node->count; i++) {
+        rows += node->child_rows[i];
+    }
+    return rows;
+}
+
+/* total visual lines below an internal node */
+int node_lines(RowNode *node)
+{
+    int lines = 0;
+    int i;
+    for (i = 0; i < node->count; i++) {
+        lines += node->child_lines[i];
+    }
+    return lines;
+}
+
+/* total text bytes below an internal node */
+long long node_bytes(RowNode *node)
+{
+    long long bytes = 0;
+    int i;
+    for (i = 0; i < node->count; i++) {
+        bytes += node->child_bytes[i];
+    }
+    return bytes;
+}
+
+/* position of a child inside its parent */
+int node_child_index(RowNode *node, void *child)
+{
+    int i = 0;
+    while (node->child[i] != child) {
+        i++;
+    }
+    return i;
+}
+
+/* get the index of a row from where it is stored */
+int row_index(ERow *row)
+{
+    RowLeaf *leaf = row_leaf(row);
+    int at = row - leaf->rows;
+    void *n = leaf;
+    RowNode *node = leaf->parent;
+    while (node) {
+        int i = node_child_index(node, n);
+        while (i-- > 0) {
+            at += node->child_rows[i];
+        }
+        n = node;
+        node = node->parent;
+    }
+    return at;
+}
+
+/* store new row, line and byte counts for a subtree and propagate them up to the root */
+void rows_refresh(void *n, int rows, int lines, long long bytes)
+{
+    RowNode *node = TREE_PARENT(n);
+    while (node) {
+        int i = node_child_index(node, n);
+        node->child_rows[i] = rows;
+        node->child_lines[i] = lines;
+        node->child_bytes[i] = bytes;
+        rows = node_rows(node);
+        lines = node_lines(node);
+        bytes = node_bytes(node);
+        n = node;
+        node = node->parent;
+    }
+}
+
+/* add to the visual lines of a leaf and of every node above it */
+void rows_add_lines(RowLeaf *leaf, int delta)
+{
+    if (delta == 0) return;
+    leaf->lines += delta;
+    void *n = leaf;
+    RowNode *node = leaf->parent;
+    while (node) {
+        node->child_lines[node_child_index(node, n)] += delta;
+        n = node;
+        node = node->parent;
+    }
+}
+
+/* add to the text bytes of a leaf and of every node above it */
+void rows_add_bytes(RowLeaf *leaf, long long delta)
+{
+    if (delta == 0) return;
+    leaf->bytes += delta;
+    void *n = leaf;
+    RowNode *node = leaf->parent;
+    while (node) {
+        node->child_bytes[node_child_index(node, n)] += delta;
+        n = node;
+        node = node->parent;
+    }
+}
+
+/*
+* insert right directly after left in left's parent, splitting the parent
+* (and growing a new root) when it is full
+*/
+void node_add_sibling(void *left, int left_rows, int left_lines, long long left_bytes,
+                      void *right, int right_rows, int right_lines, long long right_bytes)
+{
+    RowNode *parent = TREE_PARENT(left);
+    if (parent == NULL) {
+        parent = calloc(1, sizeof(RowNode));
+        if (parent == NULL) display_error("calloc");
+        parent->count = 1;
+        parent->child[0] = left;
+        TREE_PARENT(left) = parent;
+        E.buf->rows.root = parent;
+        E.buf->rows.height++;
+    }
+    int pos = node_child_index(parent, left);
+    parent->child_rows[pos] = left_rows;
+    parent->child_lines[pos] = left_lines;
+    parent->child_bytes[pos++] = left_bytes;
+
+    RowNode *target = parent;
+    RowNode *sib = NULL;
+    if (parent->count == ROW_NODE_FANOUT) {
+        /* appending at the end keeps the left node full, as on file load */
+        int keep = (pos == parent->count) ? parent->count : parent->count / 2;
+        int j;
+        sib = calloc(1, sizeof(RowNode));
+        if (sib == NULL) display_error("calloc");
+        sib->count = parent->count - keep;
+        memcpy(sib->child, &parent->child[keep], sizeof(void *) * sib->count);
+        memcpy(sib->child_rows, &parent->child_rows[keep], sizeof(int) * sib->count);
+        memcpy(sib->child_lines, &parent->child_lines[keep], sizeof(int) * sib->count);
+        memcpy(sib->child_bytes, &parent->child_bytes[keep], sizeof(long long) * sib->count);
+        for (j = 0; j < sib->count; j++) {
+            TREE_PARENT(sib->child[j]) = sib;
+        }
+        parent->count = keep;
+        if (pos >= keep) {
+            target = sib;
+            pos -= keep;
+        }
+    }
+
+    memmove(&target->child[pos + 1], &target->child[pos], sizeof(void *) * (target->count - pos));
+    memmove(&target->child_rows[pos + 1], &target->child_rows[pos], sizeof(int) * (target->count - pos));
+    memmove(&target->child_lines[pos + 1], &target->child_lines[pos], sizeof(int) * (target->count - pos));
+    memmove(&target->child_bytes[pos + 1], &target->child_bytes[pos], sizeof(long long) * (target->count - pos));
+    target->child[pos] = right;
+    target->child_rows[pos] = right_rows;
+    target->child_lines[pos] = right_lines;
+    target->child_bytes[pos] = right_bytes;
+    target->count++;
+    TREE_PARENT(right) = target;
+
+    if (sib) {
+        node_add_sibling(parent, node_rows(parent), node_lines(parent), node_bytes(parent),
+                         sib, node_rows(sib), node_lines(sib), node_bytes(sib));
+    }
+}
+
+/* unlink a child, which the caller frees, removing ancestors that become empty */
+void node_remove_child(void *child)
+{
+    RowNode *parent = TREE_PARENT(child);
+    int i = node_child_index(parent, child);
+    memmove(&parent->child[i], &parent->child[i + 1], sizeof(void *) * (parent->count - i - 1));
+    memmove(&parent->child_rows[i], &parent->child_rows[i + 1], sizeof(int) * (parent->count - i - 1));
+    memmove(&parent->child_lines[i], &parent->child_lines[i + 1], sizeof(int) * (parent->count - i - 1));
+    memmove(&parent->child_bytes[i], &parent->child_bytes[i + 1], sizeof(long long) * (parent->count - i - 1));
+    parent->count--;
+
+    if (parent->count == 0 && parent->parent) {
+        node_remove_child(parent);
+        free(parent);
+    }
+    else {
+        rows_refresh(parent, node_rows(parent), node_lines(parent), node_bytes(parent));
+    }
+}
+
+/* drop root levels that only have a single child */
+void rows_collapse_root(void)
+{
+    while (E.buf->rows.height > 0 && ((RowNode *)E.buf->rows.root)->count == 1) {
+        RowNode *root = E.buf->rows.root;
+        E.buf->rows.root = root->child[0];
+        TREE_PARENT(E.buf->rows.root) = NULL;
+        E.buf->rows.height--;
+        free(root);
+    }
+}
+
+/*
+* find the leaf of a tree holding row index at
+* returns: the leaf, with *at rewritten to the index inside that leaf
+*/
+RowLeaf *tree_find_leaf(struct RowTree *t, int *at)
+{
+    void *n = t->root;
+    int h;
+    for (h = t->height; h > 0; h--) {
+        RowNode *node = n;
+        int i = 0;
+        while (i < node->count - 1 && *at >= node->child_rows[i]) {
+            *at -= node->child_rows[i];
+            i++;
+        }
+        n = node->child[i];
+    }
+    return n;
+}
+
+/* the same in the rows of the current buffer */
+RowLeaf *rows_find_leaf(int *at)
+{
+    return tree_find_leaf(&E.buf->rows, at);
+}
+
+/* get the row at a given index of a buffer */
+ERow *buffer_row_at(struct Buffer *b, int at)
+{
+    RowLeaf *leaf = tree_find_leaf(&b->rows, &at);
+    return &leaf->rows[at];
+}
+
+/* get the row at a given index */
+ERow *row_at(int at)
+{
+    return buffer_row_at(E.buf, at);
+}
+
+/*
+* start iterating over the rows of a buffer from a given index
+* returns: the first row, or NULL when at is past the end
+*/
+ERow *buffer_iter_start(struct Buffer *b, RowIter *it, int at)
+{
+    if (at < 0 || at >= b->num_rows) {
+        it->leaf = NULL;
+        return NULL;
+    }
+    it->leaf = tree_find_leaf(&b->rows, &at);
+    it->idx = at;
+    return &it->leaf->rows[at];
+}
+
+/*
+* start iterating over rows from a given index
+* returns: the first row, or NULL when at is past the end
+*/
+ERow *row_iter_start(RowIter *it, int at)
+{
+    return buffer_iter_start(E.buf, it, at);
+}
+
+/*
+* step an iterator to the following row
+* returns: the next row, or NULL after the last one
+*/
+ERow *row_iter_next(RowIter *it)
+{
+    if (it->leaf == NULL) return NULL;
+    if (++it->idx >= it->leaf->count) {
+        it->leaf = it->leaf->next;
+        it->idx = 0;
+        if (it->leaf == NULL) return NULL;
+    }
+    return &it->leaf->rows[it->idx];
+}
+
+/* total visual lines of all rows */
+int rows_total_lines(void)
+{
+    if (E.buf->rows.height == 0) return ((RowLeaf *)E.buf->rows.root)->lines;
+    return node_lines(E.buf->rows.root);
+}
+
+/*
+* find the first visual line of a row, at may be num_rows
+* returns: lines above the row
+*/
+int row_line(int at)
+{
+    if (at >= E.buf->num_rows) return rows_total_lines();
+
+    void *n = E.buf->rows.root;
+    int line = 0;
+    int h;
+    for (h = E.buf->rows.height; h > 0; h--) {
+        RowNode *node = n;
+        int i = 0;
+        while (i < node->count - 1 && at >= node->child_rows[i]) {
+            at -= node->child_rows[i];
+            line += node->child_lines[i];
+            i++;
+        }
+        n = node->child[i];
+    }
+    RowLeaf *leaf = n;
+    int i;
+    for (i = 0; i < at; i++) {
+        line += row_lines(&leaf->rows[i]);
+    }
+    return line;
+}
+
+/*
+* find the row shown on a visual line
+* returns: the row index, num_rows past the last line, with the line
+* inside that row in *sub
+*/
+int line_row(int line, int *sub)
+{
+    *sub = 0;
+    if (line >= rows_total_lines()) return E.buf->num_rows;
+    if (line < 0) return 0;
+
+    void *n = E.buf->rows.root;
+    int at = 0;
+    int h;
+    for (h = E.buf->rows.height; h > 0; h--) {
+        RowNode *node = n;
+        int i = 0;
+        while (i < node->count - 1 && line >= node->child_lines[i]) {
+            line -= node->child_lines[i];
+            at += node->child_rows[i];
+            i++;
+        }
+        n = node->child[i];
+    }
+    RowLeaf *leaf = n;
+    int i = 0;
+    while (i < leaf->count - 1 && line >= row_lines(&leaf->rows[i])) {
+        line -= row_lines(&leaf->rows[i]);
+        i++;
+    }
+    *sub = line;
+    return at + i;
+}
+
+/* text bytes of all rows, a newline counts as one byte after each row */
+long long rows_total_bytes(void)
+{
+    if (E.buf->rows.height == 0) return ((RowLeaf *)E.buf->rows.root)->bytes + E.buf->num_rows;
+    return node_bytes(E.buf->rows.root) + E.buf->num_rows;
+}
+
+/*
+* find where a row starts in the text, at may be num_rows
+* returns: bytes before the row, newlines included
+*/
+long long row_byte(int at)
+{
+    if (at >= E.buf->num_rows) return rows_total_bytes();
+
+    void *n = E.buf->rows.root;
+    long long bytes = at;
+    int h;
+    for (h = E.buf->rows.height; h > 0; h--) {
+        RowNode *node = n;
+        int i = 0;
+        while (i < node->count - 1 && at >= node->child_rows[i]) {
+            at -= node->child_rows[i];
+            bytes += node->child_bytes[i];
+            i++;
+        }
+        n = node->child[i];
+    }
+    RowLeaf *leaf = n;
+    int i;
+    for (i = 0; i < at; i++) {
+        bytes += leaf->rows[i].size;
+    }
+    return bytes;
+}
+
+/*
+* find the row holding a byte offset of the text
+* returns: the row index, num_rows past the end, with the offset inside
+* that row in *col (its newline when it is past the text)
+*/
+int byte_row(long long offset, int *col)
+{
+    *col = 0;
+    if (offset >= rows_total_bytes()) return E.buf->num_rows;
+    if (offset < 0) return 0;
+
+    void *n = E.buf->rows.root;
+    int at = 0;
+    int h;
+    for (h = E.buf->rows.height; h > 0; h--) {
+        RowNode *node = n;
+        int i = 0;
+        while (i < node->count - 1 && offset >= node->child_bytes[i] + node->child_rows[i]) {
+            offset -= node->child_bytes[i] + node->child_rows[i];
+            at += node->child_rows[i];
+            i++;
+        }
+        n = node->child[i];
+    }
+    RowLeaf *leaf = n;
+    int i = 0;
+    while (i < leaf->count - 1 && offset > leaf->rows[i].size) {
+        offset -= leaf->rows[i].size + 1;
+        i++;
+    }
+    *col = offset;
+    return at + i;
+}
+
+/*
+* recount the visual lines of a subtree, measuring rows whose width is not
+* known when measure is set
+* returns: lines of the subtree
+*/
+int rows_rebuild_lines(void *n, int height, int measure)
+{
+    if (height == 0) {
+        RowLeaf *leaf = n;
+        int i;
+        for (i = 0; measure && i < leaf->count; i++) {
+            ERow *row = &leaf->rows[i];
+            if (row->flags & ROW_STALE) {
+                row_drop_render(row);
+                row_measure(row);
+            }
+        }
+        leaf->lines = leaf_lines(leaf);
+        return leaf->lines;
+    }
+    RowNode *node = n;
+    int i;
+    for (i = 0; i < node->count; i++) {
+        node->child_lines[i] = rows_rebuild_lines(node->child[i], height - 1, measure);
+    }
+    return node_lines(node);
+}
+
+/*
+* open an empty slot for a row at a given index
+* returns: the new slot
+*/
+ERow *rows_insert(int at)
+{
+    RowLeaf *leaf = rows_find_leaf(&at);
+    RowLeaf *split = NULL;
+
+    if (leaf->count == ROW_LEAF_CAP) {
+        RowLeaf *right = leaf_new();
+        int keep = (at == leaf->count) ? leaf->count : leaf->count / 2;
+        right->count = leaf->count - keep;
+        memcpy(right->rows, &leaf->rows[keep], sizeof(ERow) * right->count);
+        leaf->count = keep;
+        right->lines = leaf_lines(right);
+        leaf->lines -= right->lines;
+        right->bytes = leaf_bytes(right);
+        leaf->bytes -= right->bytes;
+
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next) leaf->next->prev = right;
+        leaf->next = right;
+        node_add_sibling(leaf, leaf->count, leaf->lines, leaf->bytes,
+                         right, right->count, right->lines, right->bytes);
+
+        split = leaf;
+        if (at >= keep) {
+            leaf = right;
+            at -= keep;
+        }
+        else {
+            split = right;
+        }
+    }
+
+    memmove(&leaf->rows[at + 1], &leaf->rows[at], sizeof(ERow) * (leaf->count - at));
+    leaf->count++;
+    /* the new row counts as one line until it is filled in */
+    memset(&leaf->rows[at], 0, sizeof(ERow));
+    leaf->lines++;
+    rows_refresh(leaf, leaf->count, leaf->lines, leaf->bytes);
+    if (split) rows_refresh(split, split->count, split->lines, split->bytes);
+
+    return &leaf->rows[at];
+}
+
+/* move every row of b (the next leaf of a, same parent) into a */
+void leaf_merge(RowLeaf *a, RowLeaf *b)
+{
+    memcpy(&a->rows[a->count], b->rows, sizeof(ERow) * b->count);
+    a->count += b->count;
+    a->lines += b->lines;
+    a->bytes += b->bytes;
+    a->next = b->next;
+    if (b->next) b->next->prev = a;
+    node_remove_child(b);
+    leaf_free(b);
+    rows_refresh(a, a->count, a->lines, a->bytes);
+}
+
+/* remove the slot of the row at a given index, the row must be freed already */
+void rows_remove(int at)
+{
+    RowLeaf *leaf = rows_find_leaf(&at);
+    leaf->lines -= row_lines(&leaf->rows[at]);
+    leaf->bytes -= leaf->rows[at].size;
+    memmove(&leaf->rows[at], &leaf->rows[at + 1], sizeof(ERow) * (leaf->count - at - 1));
+    leaf->count--;
+
+    if (leaf->count == 0 && E.buf->rows.height > 0) {
+        if (leaf->prev) leaf->prev->next = leaf->next;
+        if (leaf->next) leaf->next->prev = leaf->prev;
+        node_remove_child(leaf);
+        leaf_free(leaf);
+    }
+    else if (leaf->count < ROW_LEAF_CAP / 4 && leaf->next && leaf->next->parent == leaf->parent
+            && leaf->count + leaf->next->count <= ROW_LEAF_CAP) {
+        leaf_merge(leaf, leaf->next);
+    }
+    else if (leaf->count < ROW_LEAF_CAP / 4 && leaf->prev && leaf->prev->parent == leaf->parent
+            && leaf->count + leaf->prev->count <= ROW_LEAF_CAP) {
+        leaf_merge(leaf->prev, leaf);
+    }
+    else {
+        rows_refresh(leaf, leaf->count, leaf->lines, leaf->bytes);
+    }
+    rows_collapse_root();
+}
+
+/* bytes taken by the nodes and leaves of a subtree */
+size_t rows_tree_bytes(void *n, int height)
+{
+    if (height == 0) return ROW_LEAF_BYTES;
+    RowNode *node = n;
+    size_t bytes = sizeof(RowNode);
+    int i;
+    for (i = 0; i < node->count; i++) {
+        bytes += rows_tree_bytes(node->child[i], height - 1);
+    }
+    return bytes;
+}
+
+/*
+* describe the memory used for rows: text owned by rows against what the
+* arena holds, and the cost of one line including the row tree
+* returns: length of the text written to buf
+*/
+int arena_report(char *buf, size_t size)
+{
+    struct Arena *a = &E.arena;
+    size_t text = 0;
+    RowIter it;
+    ERow *row;
+    for (row = row_iter_start(&it, 0); row; row = row_iter_next(&it)) {
+        if (!(row->flags & ROW_MAPPED)) text += row->size + 1;
+        if (row->render) text += row_render_size(row);
+    }
+
+    size_t held = a->slab_bytes + a->large_bytes;
+    size_t tree = rows_tree_bytes(E.buf->rows.root, E.buf->rows.height);
+    return snprintf(buf, size, "text %zuK, arena %zuK (%zuK in use), %.0f%% waste, %.1f B/line",
+        text >> 10, held >> 10, a->used_bytes >> 10,
+        held ? 100.0 * (held - text) / held : 0.0,
+        E.buf->num_rows ? (double)(held + tree) / E.buf->num_rows : 0.0);
+}
+
+/* keep the render window on the same rows when rows are added or removed */
+void render_window_shift(int at, int delta)
+{
+    int i;
+    for (i = 0; i < E.num_windows; i++) {
+        struct Window *w = E.windows[i];
+        if (w->buf != E.buf) continue;
+        if (at < w->render_lo) w->render_lo += delta;
+        if (at < w->render_hi) w->render_hi += delta;
+    }
+}
+
+/* drop the renders of rows in [lo, hi) */
+void rows_drop_renders(int lo, int hi)
+{
+    if (lo >= hi) return;
+
+    RowIter it;
+    ERow *row = row_iter_start(&it, lo);
+    while (row && lo++ < hi) {
+        row_drop_render(row);
+        row = row_iter_next(&it);
+    }
+}
+
+/*
+* drop the renders of rows in [lo, hi) except those the render window of
+* another window on the buffer keeps, looking at the windows from i on
+*/
+void render_drop_unkept(int lo, int hi, int i)
+{
+    for (; i < E.num_windows; i++) {
+        struct Window *w = E.windows[i];
+        if (w == E.win || w->buf != E.buf || w->render_lo >= hi || w->render_hi <= lo) continue;
+        render_drop_unkept(lo, w->render_lo, i + 1);
+        render_drop_unkept(w->render_hi, hi, i + 1);
+        return;
+    }
+    rows_drop_renders(lo, hi);
+}
+
+/* move the render window around the viewport, dropping what falls out of it */
+void render_window_update(void)
+{
+    struct Window *w = E.win;
+    int lo = w->row_offset - RENDER_KEEP_SCREENS * w->height;
+    int hi = w->row_offset + (RENDER_KEEP_SCREENS + 1) * w->height;
+    if (lo < 0) lo = 0;
+
+    render_drop_unkept(w->render_lo, w->render_hi < lo ? w->render_hi : lo, 0);
+    render_drop_unkept(w->render_lo > hi ? w->render_lo : hi, w->render_hi, 0);
+    w->render_lo = lo;
+    w->render_hi = hi;
+}
+
+/* the lexer state after a row may have changed, rows from there on get checked again */
+void syntax_invalidate(int at)
+{
+    if (at < E.buf->hl_valid) E.buf->hl_valid = at;
+}
+
+/*
+* bring hl_end up to date for every row up to last: a row is lexed again
+* only when it was edited or the state it starts in changed, so an edit
+* costs the rows until the state is the same as before
+*/
+void syntax_update(int last)
+{
+    if (E.buf->syntax == NULL) return;
+    if (last >= E.buf->num_rows) last = E.buf->num_rows - 1;
+    if (E.buf->hl_valid > last) return;
+
+    int at = E.buf->hl_valid;
+    int state = at > 0 ? row_at(at - 1)->hl_end : LEX_NORMAL;
+    RowIter it;
+    ERow *row = row_iter_start(&it, at);
+    for (; row && at <= last; at++, row = row_iter_next(&it)) {
+        if (row->size >= ROW_LONG_BYTES) {
+            /* long rows are drawn without highlighting and leave the state as it was */
+            row->hl_start = row->hl_end = state;
+            row->flags |= ROW_LEXED;
+        }
+        else if (!(row->flags & ROW_LEXED) || row->hl_start != state) {
+            row->hl_start = state;
+            row->hl_end = syntax_lex(row->chars, row->size, state, NULL);
+            /* its highlight is rebuilt from the new state when it is drawn */
+            row->flags |= ROW_LEXED | ROW_STALE;
+        }
+        state = row->hl_end;
+    }
+    E.buf->hl_valid = at;
+}
+
+/* pick the highlighting for the file name, dropping highlights made for another one */
+void editor_select_syntax(void)
+{
+    struct EditorSyntax *syntax = NULL;
+    if (E.buf->filename) {
+        char *ext = strrchr(E.buf->filename, '.');
+        unsigned int j;
+        for (j = 0; j < HLDB_ENTRIES && syntax == NULL; j++) {
+            int i;
+            for (i = 0; HLDB[j].filematch[i]; i++) {
+                char *match = HLDB[j].filematch[i];
+                int is_ext = match[0] == '.';
+                if ((is_ext && ext && strcmp(ext, match) == 0)
+                        || (!is_ext && strstr(E.buf->filename, match))) {
+                    syntax = &HLDB[j];
+                    break;
+                }
+            }
+        }
+    }
+
+    if (syntax == E.buf->syntax) return;
+    int i;
+    for (i = 0; i < E.num_windows; i++) {
+        if (E.windows[i]->buf == E.buf) rows_drop_renders(E.windows[i]->render_lo, E.windows[i]->render_hi);
+    }
+    E.buf->syntax = syntax;
+    E.buf->hl_valid = 0;
+}
+
+/*
+* mark the render of a row out of date after ins bytes at at replaced del
+* bytes of its text, it is rebuilt when next drawn; the steps of a long
+* row are brought up to date right away instead
+*/
+void row_changed(ERow *row, int at, int del, int ins)
+{
+    /* the row may now take a different number of lines */
+    int lines = row_lines(row);
+    if ((row->flags & ROW_LONG) && !(row->flags & ROW_STALE)) {
+        row_long_edit(row, at, del, ins);
+        if (E.buf->wrap_cols) rows_add_lines(row_leaf(row), row_lines(row) - lines);
+    }
+    else {
+        if (E.buf->wrap_cols) {
+            row_drop_render(row);
+            row_measure(row);
+            rows_add_lines(row_leaf(row), row_lines(row) - lines);
+        }
+        row->flags |= ROW_STALE;
+    }
+    if (E.buf->syntax) syntax_invalidate(row_index(row));
+    row->flags &= ~ROW_LEXED;
+}
+
+/* insert lines of text to the editor at a given index */
+void editor_insert_row(int at, char *s, size_t len)
+{
+    if (at < 0 || at > E.buf->num_rows) return;
+
+    ERow *row = rows_insert(at);
+
+    row->size = len;
+    rows_add_bytes(row_leaf(row), len);
+    row->flags = ROW_STALE;
+    row->specials = -1;
+    row->chars = row_text_alloc(row, len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->rsize = 0;
+    row->render = NULL;
+    if (E.buf->wrap_cols) {
+        row_measure(row);
+        rows_add_lines(row_leaf(row), row_lines(row) - 1);
+    }
+    syntax_invalidate(at);
+
+    render_window_shift(at, 1);
+    E.buf->num_rows++;
+    E.buf->dirty++;
+}
+
+/* append a row that refers to a line of the mapped file without copying it */
+void editor_append_mapped_row(char *s, size_t len)
+{
+    ERow *row = rows_insert(E.buf->num_rows);
+    row->size = len;
+    rows_add_bytes(row_leaf(row), len);
+    row->flags = ROW_MAPPED | ROW_STALE;
+    row->specials = -1;
+    row->cap = 0;
+    row->chars = s;
+    row->rsize = 0;
+    row->render = NULL;
+    if (E.buf->wrap_cols) {
+        row_measure(row);
+        rows_add_lines(row_leaf(row), row_lines(row) - 1);
+    }
+    render_window_shift(E.buf->num_rows, 1);
+    E.buf->num_rows++;
+}
+
+/* keep row text a running save still writes until the save is done */
+void row_orphan(ERow *row)
+{
+    if (E.buf->num_orphans == E.buf->orphans_cap) {
+        E.buf->orphans_cap = E.buf->orphans_cap ? E.buf->orphans_cap * 2 : 64;
+        E.buf->orphans = realloc(E.buf->orphans, sizeof(struct iovec) * E.buf->orphans_cap);
+        if (E.buf->orphans == NULL) display_error("realloc");
+    }
+    E.buf->orphans[E.buf->num_orphans].iov_base = row->chars;
+    E.buf->orphans[E.buf->num_orphans++].iov_len = row_cap(row);
+}
+
+/*
+* give a row its own copy of the text before it gets modified, when it
+* points into the mapped file or is shared with a running save
+*/
+void row_materialize(ERow *row)
+{
+    if (!(row->flags & (ROW_MAPPED | ROW_SHARED))) return;
+    int cap;
+    char *chars = text_alloc(row->size + 1, &cap);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (row->flags & ROW_SHARED) row_orphan(row);
+    row->chars = chars;
+    row->cap = arena_class(cap);
+    row->flags &= ~(ROW_MAPPED | ROW_SHARED);
+    row_changed(row, 0, 0, 0);
+}
+
+/* free memory owned by a row */
+void free_row(ERow *row)
+{
+    if (row->flags & ROW_SHARED) {
+        row_orphan(row);
+    }
+    else if (!(row->flags & ROW_MAPPED)) {
+        text_free(row->chars, row_cap(row));
+    }
+    row_drop_render(row);
+}
+
+/*
+* newline scanners: each one stores the offsets of up to max '\n' bytes
+* of buf into ends
+* returns: the number of offsets stored
+*/
+size_t find_newlines_scalar(const char *buf, size_t len, size_t *ends, size_t max)
+{
+    size_t n = 0;
+    const char *p = buf;
+    const char *end = buf + len;
+    while (n < max && (p = memchr(p, '\n', end - p)) != NULL) {
+        ends[n++] = p - buf;
+        p++;
+    }
+    return n;
+}
+
+/* scan the tail a vector loop left over, keeping offsets relative to buf */
+size_t find_newlines_tail(const char *buf, size_t len, size_t from, size_t *ends, size_t n, size_t max)
+{
+    size_t found = find_newlines_scalar(buf + from, len - from, ends + n, max - n);
+    size_t j;
+    for (j = n; j < n + found; j++) {
+        ends[j] += from;
+    }
+    return n + found;
+}
+
+#if defined(__SSE2__)
+size_t find_newlines_sse2(const char *buf, size_t len, size_t *ends, size_t max)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            ends[n++] = i + __builtin_ctz(mask);
+            if (n == max) return n;
+            mask &= mask - 1;
+        }
+    }
+    return find_newlines_tail(buf, len, i, ends, n, max);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_AVX2_SCANNER
+__attribute__((target("avx2")))
+size_t find_newlines_avx2(const char *buf, size_t len, size_t *ends, size_t max)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        unsigned long long mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl))
+            | (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+        while (mask) {
+            ends[n++] = i + __builtin_ctzll(mask);
+            if (n == max) return n;
+            mask &= mask - 1;
+        }
+    }
+    return find_newlines_tail(buf, len, i, ends, n, max);
+}
+#endif
+
+#if defined(__ARM_NEON)
+size_t find_newlines_neon(const char *buf, size_t len, size_t *ends, size_t max)
+{
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)(buf + i)), nl);
+        /* narrow to 4 mask bits per byte, there is no movemask on NEON */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask);
+            ends[n++] = i + (bit >> 2);
+            if (n == max) return n;
+            mask &= ~(0xfULL << (bit & ~3));
+        }
+    }
+    return find_newlines_tail(buf, len, i, ends, n, max);
+}
+#endif
+
+typedef size_t (*NewlineScanner)(const char *, size_t, size_t *, size_t);
+
+/* pick the widest newline scanner this CPU supports */
+NewlineScanner pick_newline_scanner(void)
+{
+#ifdef HAVE_AVX2_SCANNER
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_newlines_avx2;
+#endif
+#if defined(__SSE2__)
+    return find_newlines_sse2;
+#elif defined(__ARM_NEON)
+    return find_newlines_neon;
+#else
+    return find_newlines_scalar;
+#endif
+}
+
+/* find newlines with the best scanner available */
+size_t find_newlines(const char *buf, size_t len, size_t *ends, size_t max)
+{
+    static NewlineScanner scan = NULL;
+    if (scan == NULL) {
+        scan = pick_newline_scanner();
+    }
+    return scan(buf, len, ends, max);
+}
+
+/*
+* build the name of a file kept next to path, .name.ext
+* returns: malloc'd path
+*/
+char *sidecar_path(const char *path, const char *ext)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? slash - path + 1 : 0;
+    size_t size = strlen(path) + strlen(ext) + 3;
+    char *sidecar = malloc(size);
+    snprintf(sidecar, size, "%.*s.%s.%s", dir_len, path, path + dir_len, ext);
+    return sidecar;
+}
+
+/*
+* check whether the mapped file is big enough to keep its line index
+* returns: 1 if the lines indexed are logged for the index cache, 0 otherwise
+*/
+int index_cache_wanted(void)
+{
+    return E.buf->map && E.buf->map_len >= INDEX_CACHE_MIN_SIZE;
+}
+
+/* log a complete line of size bytes and crs carriage returns before its newline */
+void index_log_add(size_t size, size_t crs)
+{
+    unsigned char buf[20];
+    int len = 0;
+    uint64_t v = (uint64_t)size << 1 | (crs > 0);
+    int k;
+    /* lengths go in as varints, most lines take one or two bytes */
+    for (k = 0; k < 2; k++) {
+        do {
+            buf[len++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+            v >>= 7;
+        } while (v);
+        if (crs == 0) break;
+        v = crs;
+    }
+    /* a log that grew this big stops, the cache then covers the lines before */
+    struct AppendBuf *log = &E.buf->index_log;
+    if (log->len > INT_MAX / 4 || ab_reserve(log, len) == -1) return;
+    ab_append(log, (char *)buf, len);
+    /* the line is a row already */
+    E.buf->index_pos = log->len;
+    E.buf->index_bytes += size + crs + 1;
+}
+
+/*
+* read a varint from the index log
+* returns: its value, or 0 with index_pos at the end when it is cut off
+*/
+uint64_t index_log_varint(void)
+{
+    struct AppendBuf *log = &E.buf->index_log;
+    uint64_t v = 0;
+    int shift = 0;
+    while (E.buf->index_pos < log->len && shift < 64) {
+        unsigned char c = log->buf[E.buf->index_pos++];
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+        shift += 7;
+    }
+    E.buf->index_pos = log->len;
+    return 0;
+}
+
+/*
+* FNV-1a over len bytes, going on from the hash h of what came before
+* returns: the hash
+*/
+uint64_t hash_bytes(uint64_t h, const char *s, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* hash blocks sampled evenly from the first size bytes of the mapping */
+uint64_t index_cache_hash(size_t size)
+{
+    uint64_t h = HASH_SEED;
+    int k;
+    for (k = 0; k < INDEX_SAMPLES; k++) {
+        size_t len = size < INDEX_SAMPLE_BYTES ? size : INDEX_SAMPLE_BYTES;
+        size_t off = (size - len) / (INDEX_SAMPLES - 1) * k;
+        h = hash_bytes(h, E.buf->map + off, len);
+    }
+    return h ^ size;
+}
+
+/*
+* take the line index of the mapped file from its cache, when the cache was
+* made for the file as it is or for a start of it the rest was appended to
+*/
+void index_cache_load(void)
+{
+    if (!index_cache_wanted()) return;
+    char *path = realpath(E.buf->filename, NULL);
+    if (path == NULL) return;
+    char *cache = sidecar_path(path, "idx");
+    free(path);
+    int fd = open(cache, O_RDONLY);
+    free(cache);
+    if (fd == -1) return;
+
+    struct IndexCacheHeader h;
+    struct AppendBuf *log = &E.buf->index_log;
+    struct stat st;
+    /* the log must be in the file after the header before any of it is allocated */
+    int ok = fstat(fd, &st) == 0 && read(fd, &h, sizeof(h)) == sizeof(h) && memcmp(h.magic, "txtidx2", 8) == 0
+        && h.log_len <= (uint64_t)st.st_size - sizeof(h)
+        && h.size <= E.buf->map_len && h.bytes <= h.size && h.log_len < INT_MAX
+        && (h.size < E.buf->map_len || (h.mtime_sec == E.buf->map_mtime.tv_sec && h.mtime_nsec == E.buf->map_mtime.tv_nsec))
+        && index_cache_hash(h.size) == h.hash;
+    if (ok) {
+        ab_reset(log);
+        ok = ab_reserve(log, h.log_len) == 0 && read(fd, log->buf, h.log_len) == (ssize_t)h.log_len
+            && hash_bytes(HASH_SEED, log->buf, h.log_len) == h.log_hash;
+    }
+    close(fd);
+    if (!ok) return;
+
+    log->len = h.log_len;
+    E.buf->index_pos = 0;
+    E.buf->index_bytes = h.bytes;
+    E.buf->index_saved = h.size == E.buf->map_len ? h.bytes : 0;
+}
+
+/* write the line index of the mapped file, indexed to its end, to its cache */
+void index_cache_save(void)
+{
+    struct Buffer *b = E.buf;
+    struct stat st;
+    /* only while the file is still the one mapped, not replaced by a save */
+    if (b->index_bytes == b->index_saved || stat(b->filename, &st) == -1 || (size_t)st.st_size != b->map_len
+            || st.st_mtim.tv_sec != b->map_mtime.tv_sec || st.st_mtim.tv_nsec != b->map_mtime.tv_nsec) {
+        return;
+    }
+    char *path = realpath(b->filename, NULL);
+    if (path == NULL) return;
+    char *cache = sidecar_path(path, "idx");
+    free(path);
+    size_t tmp_size = strlen(cache) + 8;
+    char *tmp = malloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.XXXXXX", cache);
+
+    struct IndexCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "txtidx2", 8);
+    h.size = b->map_len;
+    h.mtime_sec = b->map_mtime.tv_sec;
+    h.mtime_nsec = b->map_mtime.tv_nsec;
+    h.hash = index_cache_hash(b->map_len);
+    h.bytes = b->index_bytes;
+    h.log_len = b->index_log.len;
+    h.log_hash = hash_bytes(HASH_SEED, b->index_log.buf, b->index_log.len);
+
+    int fd = mkstemp(tmp);
+    if (fd != -1) {
+        int ok = write(fd, &h, sizeof(h)) == sizeof(h)
+            && write(fd, b->index_log.buf, b->index_log.len) == b->index_log.len;
+        if (close(fd) == -1) ok = 0;
+        if (!ok || rename(tmp, cache) == -1) unlink(tmp);
+    }
+    free(tmp);
+    free(cache);
+}
+
+/*
+* make rows of the mapped lines the index log has, budget bytes of them,
+* without reading the text of the file
+* returns: 1 if there is more to index, 0 when done
+*/
+int rows_index_cached(size_t budget)
+{
+    struct Buffer *b = E.buf;
+    size_t end = b->map_scan + budget;
+    while (b->map_scan < end && b->index_pos < b->index_log.len) {
+        int at = b->index_pos;
+        uint64_t v = index_log_varint();
+        uint64_t crs = v & 1 ? index_log_varint() : 0;
+        size_t size = v >> 1;
+        if (b->map_scan + size + crs + 1 > b->map_len) {
+            /* a corrupt log: drop it from this entry on and scan from here instead */
+            b->index_log.len = b->index_pos = at;
+            b->index_bytes = b->map_scan;
+            b->index_saved = 0;
+            break;
+        }
+        editor_append_mapped_row(b->map + b->map_scan, size);
+        b->map_scan += size + crs + 1;
+    }
+    return b->map_scan < b->map_len;
+}
+
+/*
+* add one line as a row, without its line ending
+* returns: length of the row
+*/
+size_t rows_append_line(char *line, size_t len, int mapped)
+{
+    while (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    if (mapped) {
+        editor_append_mapped_row(line, len);
+    }
+    else {
+        /* lines coming in from the file do not modify it */
+        int dirty = E.buf->dirty;
+        editor_insert_row(E.buf->num_rows, line, len);
+        E.buf->dirty = dirty;
+    }
+    return len;
+}
+
+/*
+* split buf into rows at every newline, either pointing into buf or copied
+* returns: bytes consumed; a trailing line without newline is left over
+*/
+size_t rows_append_lines(char *buf, size_t len, int mapped)
+{
+    size_t ends[INDEX_BATCH];
+    size_t pos = 0;
+    size_t n;
+    do {
+        n = find_newlines(buf + pos, len - pos, ends, INDEX_BATCH);
+        size_t start = 0;
+        size_t i;
+        for (i = 0; i < n; i++) {
+            size_t size = rows_append_line(buf + pos + start, ends[i] - start, mapped);
+            if (mapped && index_cache_wanted()) index_log_add(size, ends[i] - start - size);
+            start = ends[i] + 1;
+        }
+        pos += start;
+    } while (n == INDEX_BATCH);
+    return pos;
+}
+
+/* let a block of the mapping go, its pages are read from the file again when touched */
+void map_drop_block(size_t block)
+{
+    size_t off = block * MAP_BLOCK_BYTES;
+    if (off >= E.buf->map_len) return;
+    size_t len = E.buf->map_len - off < MAP_BLOCK_BYTES ? E.buf->map_len - off : MAP_BLOCK_BYTES;
+    madvise(E.buf->map + off, len, MADV_DONTNEED);
+}
+
+/*
+* check whether a mapping is too big to keep all of it in memory
+* returns: 1 if its blocks are dropped once they go cold, 0 otherwise
+*/
+int map_bounded(void)
+{
+    return E.buf->map && E.buf->map_len > (size_t)MAP_HOT_BLOCKS * MAP_BLOCK_BYTES;
+}
+
+/*
+* note that the mapped text at p is read: its block goes to the front of the
+* hot ones, dropping the block read longest ago when there are too many
+*/
+void map_touch(const char *p)
+{
+    struct Buffer *b = E.buf;
+    if (!map_bounded()) return;
+    size_t block = (p - b->map) / MAP_BLOCK_BYTES;
+    if (b->map_num_hot && b->map_hot[0] == block) return;
+
+    int i;
+    for (i = 0; i < b->map_num_hot && b->map_hot[i] != block; i++);
+    if (i == b->map_num_hot) {
+        if (i == MAP_HOT_BLOCKS) {
+            map_drop_block(b->map_hot[--i]);
+        }
+        else {
+            b->map_num_hot++;
+        }
+    }
+    memmove(&b->map_hot[1], &b->map_hot[0], sizeof(size_t) * i);
+    b->map_hot[0] = block;
+}
+
+/* drop the blocks in [from, to) that are not hot, after something read through them */
+void map_trim(size_t from, size_t to)
+{
+    if (!map_bounded()) return;
+    size_t blocks = (E.buf->map_len + MAP_BLOCK_BYTES - 1) / MAP_BLOCK_BYTES;
+    if (to > blocks) to = blocks;
+    size_t block;
+    for (block = from; block < to; block++) {
+        int i;
+        for (i = 0; i < E.buf->map_num_hot && E.buf->map_hot[i] != block; i++);
+        if (i == E.buf->map_num_hot) map_drop_block(block);
+    }
+}
+
+/*
+* split up to budget bytes of the mapped file into rows
+* returns: 1 if there is still text left to index, 0 otherwise
+*/
+int rows_index_more(size_t budget)
+{
+    if (E.buf->index_pos < E.buf->index_log.len) {
+        return rows_index_cached(budget);
+    }
+    size_t end = E.buf->map_scan + budget;
+    if (end > E.buf->map_len) end = E.buf->map_len;
+    map_touch(E.buf->map + E.buf->map_scan);
+    map_touch(E.buf->map + end - 1);
+
+    size_t used = rows_append_lines(E.buf->map + E.buf->map_scan, end - E.buf->map_scan, 1);
+    if (used == 0 && end < E.buf->map_len) {
+        /* a line longer than the budget: take all of it in one go */
+        size_t nl;
+        end = E.buf->map_len;
+        if (find_newlines(E.buf->map + E.buf->map_scan, E.buf->map_len - E.buf->map_scan, &nl, 1)) {
+            end = E.buf->map_scan + nl + 1;
+        }
+        used = rows_append_lines(E.buf->map + E.buf->map_scan, end - E.buf->map_scan, 1);
+    }
+    E.buf->map_scan += used;
+
+    if (end == E.buf->map_len && E.buf->map_scan < E.buf->map_len) {
+        rows_append_line(E.buf->map + E.buf->map_scan, E.buf->map_len - E.buf->map_scan, 1);
+        E.buf->map_scan = E.buf->map_len;
+    }
+    if (E.buf->map_scan == E.buf->map_len && index_cache_wanted()) {
+        index_cache_save();
+        ab_free(&E.buf->index_log);
+        E.buf->index_pos = 0;
+    }
+    return E.buf->map_scan < E.buf->map_len;
+}
+
+/* delete a row*/
+void delete_row(int at)
+{
+    if (at < 0 || at >= E.buf->num_rows) return;
+    free_row(row_at(at));
+    rows_remove(at);
+    syntax_invalidate(at);
+    render_window_shift(at, -1);
+    E.buf->num_rows--;
+    E.buf->dirty++;
+}
+
+/* split whatever is left in the read buffer into a last row and stop reading */
+void rows_read_finish(void)
+{
+    if (E.buf->load_len > 0) {
+        rows_append_line(E.buf->load_buf, E.buf->load_len, 0);
+    }
+    free(E.buf->load_buf);
+    E.buf->load_buf = NULL;
+    E.buf->load_len = 0;
+    E.buf->load_cap = 0;
+    close(E.buf->load_fd);
+    E.buf->load_fd = -1;
+}
+
+/*
+* read the next part of a file that is not mapped into rows, a regular
+* file is read until budget bytes came in, anything else gets a single
+* read so a pipe only blocks when it has nothing at all
+* returns: 1 if there is still more to read, 0 once the file is loaded
+* (or, following it, read up to its current end)
+*/
+int rows_read_more(size_t budget)
+{
+    size_t got = 0;
+    while (E.buf->load_fd != -1 && !E.buf->load_eof) {
+        /* carry the unfinished last line over, growing for lines longer than the buffer */
+        if (E.buf->load_len == E.buf->load_cap) {
+            E.buf->load_cap *= 2;
+            E.buf->load_buf = realloc(E.buf->load_buf, E.buf->load_cap);
+            if (E.buf->load_buf == NULL) display_error("realloc");
+        }
+        ssize_t nread = read(E.buf->load_fd, E.buf->load_buf + E.buf->load_len, E.buf->load_cap - E.buf->load_len);
+        if (nread == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 1;
+            display_error("read");
+        }
+        if (nread == 0) {
+            if (!E.buf->follow) {
+                rows_read_finish();
+                return 0;
+            }
+            /* show the unfinished last line until the rest of it is written */
+            if (E.buf->load_len > 0 && !E.buf->follow_partial) {
+                rows_append_line(E.buf->load_buf, E.buf->load_len, 0);
+                E.buf->follow_partial = 1;
+            }
+            E.buf->load_eof = 1;
+            return 0;
+        }
+        if (E.buf->follow_partial) {
+            int dirty = E.buf->dirty;
+            delete_row(E.buf->num_rows - 1);
+            E.buf->dirty = dirty;
+            E.buf->follow_partial = 0;
+        }
+        E.buf->load_len += nread;
+        E.buf->load_read += nread;
+        got += nread;
+        size_t used = rows_append_lines(E.buf->load_buf, E.buf->load_len, 0);
+        memmove(E.buf->load_buf, E.buf->load_buf + used, E.buf->load_len - used);
+        E.buf->load_len -= used;
+        if (!E.buf->load_size || got >= budget) return 1;
+    }
+    return 0;
+}
+
+/* part of the opened file is still to be split into rows */
+int rows_loading(void)
+{
+    return (E.buf->map && E.buf->map_scan < E.buf->map_len) || (E.buf->load_fd != -1 && !E.buf->load_eof);
+}
+
+/*
+* load about budget more bytes of the opened file, whichever way it is read
+* returns: 1 if there is still more to load, 0 otherwise
+*/
+int rows_load_more(size_t budget)
+{
+    if (E.buf->map) return rows_index_more(budget);
+    if (E.buf->load_fd != -1) return rows_read_more(budget);
+    return 0;
+}
+
+/*
+* give up on a long load when ^Q is waiting in the input, only with no
+* unsaved changes, otherwise the key stays queued for the usual warning
+*/
+void load_check_abort(void)
+{
+    struct pollfd pfd = {E.input.fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) == 1) {
+        input_fill();
+    }
+    if (!E.buf->dirty && input_quit_waiting()) {
+        editor_exit();
+    }
+}
+
+/* load the opened file until row at and byte offset exist or the file ends */
+void rows_ensure_to(int at, long long offset)
+{
+    size_t loaded = 0;
+    while ((at >= E.buf->num_rows || offset >= rows_total_bytes()) && rows_loading()) {
+        if (E.buf->load_fd != -1 && !E.buf->load_size) {
+            /* a pipe can take any time to deliver, watch the keyboard meanwhile */
+            struct pollfd fds[2] = {
+                {E.buf->load_fd, POLLIN, 0},
+                {E.input.end < INPUT_BUF_SIZE ? E.input.fd : -1, POLLIN, 0}
+            };
+            if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+                display_error("poll");
+            }
+            if (fds[1].revents) load_check_abort();
+            if (!fds[0].revents) continue;
+        }
+        rows_load_more(INDEX_CHUNK);
+        loaded += INDEX_CHUNK;
+        if (loaded % IDLE_INDEX_BYTES == 0) {
+            load_check_abort();
+        }
+    }
+}
+
+/* load the opened file until row at exists or the file ends */
+void rows_ensure(int at)
+{
+    rows_ensure_to(at, 0);
+}
+
+/*
+* describe how far loading got for the status bar
+* returns: length of the text written to buf
+*/
+int load_progress(char *buf, size_t size)
+{
+    size_t done = E.buf->map ? E.buf->map_scan : E.buf->load_read;
+    size_t total = E.buf->map ? E.buf->map_len : E.buf->load_size;
+    int len;
+    if (total) {
+        int pct = done * 100.0 / total;
+        len = snprintf(buf, size, "(loading %d%%) ", pct > 99 ? 99 : pct);
+    }
+    else {
+        len = snprintf(buf, size, "(loading %zu MB) ", done >> 20);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/*
+* watch the file being read for follow mode, and its directory so a log
+* that is rotated away gets followed again under its name
+* returns: 0 on success, -1 on error
+*/
+int follow_start(void)
+{
+    struct stat st;
+    if (fstat(E.buf->load_fd, &st) == -1) return -1;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    E.buf->follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.buf->follow_fd == -1) return -1;
+    E.buf->follow_wd = inotify_add_watch(E.buf->follow_fd, E.buf->filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (E.buf->follow_wd == -1) return -1;
+
+    char *slash = strrchr(E.buf->filename, '/');
+    char *dir = slash ? strndup(E.buf->filename, slash == E.buf->filename ? 1 : slash - E.buf->filename) : strdup(".");
+    E.buf->follow_dir_wd = inotify_add_watch(E.buf->follow_fd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+
+    E.buf->follow_tail = 1;
+    E.win->cursor_y = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+    return 0;
+}
+
+/* the unfinished last line ends with the file it was in, keep its row as it is */
+void follow_end_line(void)
+{
+    E.buf->load_len = 0;
+    E.buf->follow_partial = 0;
+}
+
+/* the file got shorter than what was read, e.g. copytruncate rotation: read it again from its start */
+void follow_truncated(void)
+{
+    follow_end_line();
+    lseek(E.buf->load_fd, 0, SEEK_SET);
+    E.buf->load_read = 0;
+    set_status_message("%s was truncated", E.buf->filename);
+}
+
+/* switch over to a new file at the followed name, once the old one is read to its end */
+void follow_reopen(void)
+{
+    int fd = open(E.buf->filename, O_RDONLY);
+    if (fd == -1) return;
+    struct stat st, old;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (fstat(E.buf->load_fd, &old) == 0 && old.st_ino == st.st_ino && old.st_dev == st.st_dev)) {
+        close(fd);
+        return;
+    }
+
+    /* what was written before the rotation still belongs on screen */
+    E.buf->load_eof = 0;
+    while (rows_read_more(IDLE_INDEX_BYTES));
+    follow_end_line();
+
+    close(E.buf->load_fd);
+    E.buf->load_fd = fd;
+    E.buf->load_read = 0;
+    E.buf->load_size = st.st_size;
+    E.buf->load_eof = 0;
+    inotify_rm_watch(E.buf->follow_fd, E.buf->follow_wd);
+    E.buf->follow_wd = inotify_add_watch(E.buf->follow_fd, E.buf->filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    set_status_message("%s was replaced, following the new file", E.buf->filename);
+}
+
+/* act on what inotify saw happen to the followed file */
+void follow_events(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *slash = strrchr(E.buf->filename, '/');
+    const char *base = slash ? slash + 1 : E.buf->filename;
+    int grew = 0, replaced = 0;
+    ssize_t len;
+    while ((len = read(E.buf->follow_fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->wd == E.buf->follow_wd && (ev->mask & IN_MODIFY)) {
+                grew = 1;
+            }
+            else if (ev->wd == E.buf->follow_dir_wd && ev->len && strcmp(ev->name, base) == 0) {
+                replaced = 1;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if (grew) {
+        struct stat st;
+        if (fstat(E.buf->load_fd, &st) == 0 && (size_t)st.st_size < E.buf->load_read) {
+            follow_truncated();
+        }
+        E.buf->load_eof = 0;
+    }
+    if (replaced) {
+        follow_reopen();
+    }
+}
+
+/*
+* after new rows came in, drop the oldest ones past follow_max and keep the
+* cursor on the last row when it was following it; not while a search is
+* open, its matches are row indices
+*/
+void follow_update(void)
+{
+    if (E.search.active) return;
+
+    int drop = E.buf->follow_max ? E.buf->num_rows - E.buf->follow_max : 0;
+    if (drop > 0) {
+        int dirty = E.buf->dirty;
+        int i;
+        for (i = 0; i < drop; i++) {
+            delete_row(0);
+        }
+        E.buf->dirty = dirty;
+        E.win->cursor_y = E.win->cursor_y > drop ? E.win->cursor_y - drop : 0;
+        if (E.win->row_offset > drop) {
+            E.win->row_offset -= drop;
+        }
+        else {
+            E.win->row_offset = 0;
+            E.win->wrap_skip = 0;
+        }
+    }
+    if (E.buf->follow_tail) {
+        E.win->cursor_y = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+        E.win->cursor_x = 0;
+    }
+}
+
+/* background work is pending while part of the mapped file is not indexed */
+int editor_has_idle_work(void)
+{
+    return E.buf->map && E.buf->map_scan < E.buf->map_len;
+}
+
+/* do a slice of background work while waiting for input */
+void editor_idle(void)
+{
+    if (editor_has_idle_work()) {
+        rows_index_more(IDLE_INDEX_BYTES);
+        refresh_screen();
+    }
+}
+
+/* insert a string into a row at a given index */
+void row_insert_string(ERow *row, int at, char *s, size_t len)
+{
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    row_materialize(row);
+    row_text_grow(row, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    rows_add_bytes(row_leaf(row), len);
+    row_changed(row, at, 0, len);
+    E.buf->dirty++;
+}
+
+/* cut a row short at a given index */
+void row_truncate(ERow *row, int at)
+{
+    if (at < 0 || at >= row->size) return;
+    row_materialize(row);
+    int del = row->size - at;
+    rows_add_bytes(row_leaf(row), -del);
+    row->size = at;
+    row->chars[at] = '\0';
+    row_changed(row, at, del, 0);
+    E.buf->dirty++;
+}
+
+/* append a string to a row */
+void row_append_string(ERow *row, char *s, size_t len)
+{
+    row_materialize(row);
+    row_text_grow(row, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    rows_add_bytes(row_leaf(row), len);
+    row->chars[row->size] = '\0';
+    row_changed(row, row->size - len, 0, len);
+    E.buf->dirty++;
+}
+
+/* delete len characters from a row at a given index */
+void row_delete_string(ERow *row, int at, int len)
+{
+    if (at < 0 || len <= 0 || at + len > row->size) return;
+    row_materialize(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    rows_add_bytes(row_leaf(row), -len);
+    row_changed(row, at, len, 0);
+    E.buf->dirty++;
+}
+
+/* give a row a copy of new text in one change, for a replace-all */
+void row_set_text(ERow *row, const char *s, int len)
+{
+    if (row->flags & ROW_SHARED) {
+        row_orphan(row);
+    }
+    else if (!(row->flags & ROW_MAPPED)) {
+        text_free(row->chars, row_cap(row));
+    }
+    row->chars = row_text_alloc(row, len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->flags &= ~(ROW_MAPPED | ROW_SHARED);
+    rows_add_bytes(row_leaf(row), len - row->size);
+    int del = row->size;
+    row->size = len;
+    row_changed(row, 0, del, len);
+    E.buf->dirty++;
+}
+
+/* keep the next edit out of the last undo record */
+void undo_seal(void)
+{
+    E.buf->undo.sealed = 1;
+}
+
+/*
+* drop the oldest records until the log is at most max bytes, never
+* leaving the tail of a group behind; the last group stays whole even
+* when it is bigger than max
+*/
+void undo_trim(size_t max)
+{
+    struct Undo *u = &E.buf->undo;
+    size_t keep = u->group < u->pos ? u->group : u->pos;
+    size_t drop = 0;
+    while (u->end - drop > max && drop < keep) {
+        struct UndoRecord *rec = (struct UndoRecord *)(u->log + drop);
+        drop += rec->size;
+    }
+    while (drop < u->pos && ((struct UndoRecord *)(u->log + drop))->flags & UNDO_GROUP) {
+        drop += ((struct UndoRecord *)(u->log + drop))->size;
+    }
+    if (drop == 0) return;
+
+    memmove(u->log, u->log + drop, u->end - drop);
+    u->pos -= drop;
+    u->end -= drop;
+    u->group = u->group > drop ? u->group - drop : 0;
+    if (u->pos == 0) u->last_size = 0;
+    if (u->end > 0) ((struct UndoRecord *)u->log)->prev = 0;
+}
+
+/* grow the log so it can hold need bytes */
+void undo_reserve(size_t need)
+{
+    struct Undo *u = &E.buf->undo;
+    if (need <= u->cap) return;
+    size_t cap = u->cap ? u->cap : 4096;
+    while (cap < need) cap *= 2;
+    char *log = realloc(u->log, cap);
+    if (log == NULL) display_error("realloc");
+    u->log = log;
+    u->cap = cap;
+}
+
+/* size of a record holding len bytes of text, keeping the next one aligned */
+int undo_record_size(int len)
+{
+    int size = sizeof(struct UndoRecord) + len;
+    return (size + 7) & ~7;
+}
+
+/*
+* add one character to the last record when it is the same kind of edit
+* right next to this one: typed characters append, backspaces prepend
+* returns: 1 if the edit was merged, 0 otherwise
+*/
+int undo_coalesce(int type, int y, int x, const char *s, int len)
+{
+    struct Undo *u = &E.buf->undo;
+    if (u->sealed || u->last_size == 0 || u->pos != u->end || len == 0 || s[0] == '\n') return 0;
+    int cp;
+    if (utf8_decode(s, len, &cp) != len) return 0;
+
+    struct UndoRecord *rec = (struct UndoRecord *)(u->log + u->pos - u->last_size);
+    if (rec->type != type || rec->y != y || rec->len + len > UNDO_COALESCE_MAX) return 0;
+    if (type == UNDO_INSERT && x != rec->x + rec->len) return 0;
+    if (type == UNDO_DELETE && x != rec->x - len) return 0;
+
+    int size = undo_record_size(rec->len + len);
+    if (size > rec->size) {
+        /* the record is last in the log, so it can grow in place */
+        undo_reserve(u->pos - rec->size + size);
+        rec = (struct UndoRecord *)(u->log + u->pos - u->last_size);
+        u->pos += size - rec->size;
+        u->end = u->pos;
+        rec->size = size;
+        u->last_size = size;
+    }
+    char *text = (char *)(rec + 1);
+    if (type == UNDO_INSERT) {
+        memcpy(text + rec->len, s, len);
+    }
+    else {
+        memmove(text + len, text, rec->len);
+        memcpy(text, s, len);
+        rec->x -= len;
+    }
+    rec->len += len;
+    return 1;
+}
+
+/* log an edit for undo, dropping whatever could have been redone */
+void undo_record(int type, int flags, int y, int x, const char *s, int len)
+{
+    struct Undo *u = &E.buf->undo;
+    if (u->replaying) return;
+    u->end = u->pos;
+    if (!flags && undo_coalesce(type, y, x, s, len)) return;
+
+    int size = undo_record_size(len);
+    undo_reserve(u->end + size);
+    struct UndoRecord *rec = (struct UndoRecord *)(u->log + u->end);
+    rec->prev = u->last_size;
+    rec->size = size;
+    rec->type = type;
+    rec->flags = flags;
+    rec->y = y;
+    rec->x = x;
+    rec->len = len;
+    if (len) memcpy(rec + 1, s, len);
+    if (!(flags & UNDO_GROUP)) u->group = u->end;
+    u->pos = u->end += size;
+    u->last_size = size;
+    u->sealed = 0;
+
+    if (u->end > UNDO_MAX_BYTES) undo_trim(UNDO_MAX_BYTES / 2);
+}
+
+/*
+* refuse to edit in follow mode
+* returns: 1 if the text is read-only
+*/
+int editor_read_only(void)
+{
+    if (!E.buf->follow) return 0;
+    set_status_message("Read-only while following the file");
+    return 1;
+}
+
+/* insert a character into the position of the cursor */
+void insert_char(int c)
+{
+    if (editor_read_only()) return;
+
+    char ch[4];
+    int len = utf8_encode(c, ch);
+    int flags = 0;
+    if (E.win->cursor_y == E.buf->num_rows) {
+        undo_record(UNDO_ADD_ROW, 0, E.win->cursor_y, 0, NULL, 0);
+        editor_insert_row(E.buf->num_rows, "", 0);
+        flags = UNDO_GROUP;
+    }
+    undo_record(UNDO_INSERT, flags, E.win->cursor_y, E.win->cursor_x, ch, len);
+    row_insert_string(row_at(E.win->cursor_y), E.win->cursor_x, ch, len);
+    E.win->cursor_x += len;
+}
+
+/* insert a newline */
+void insert_newline(void)
+{
+    if (editor_read_only()) return;
+
+    if (E.win->cursor_y == E.buf->num_rows) {
+        undo_record(UNDO_ADD_ROW, 0, E.win->cursor_y, 0, NULL, 0);
+    }
+    else {
+        undo_record(UNDO_INSERT, 0, E.win->cursor_y, E.win->cursor_x, "\n", 1);
+    }
+
+    if (E.win->cursor_x == 0) {
+        editor_insert_row(E.win->cursor_y, "", 0);
+    }
+    else {
+        ERow *row = row_at(E.win->cursor_y);
+        editor_insert_row(E.win->cursor_y + 1, &row->chars[E.win->cursor_x], row->size - E.win->cursor_x);
+        row_truncate(row_at(E.win->cursor_y), E.win->cursor_x);
+    }    
+    E.win->cursor_y++;
+    E.win->cursor_x = 0;
+}
+
+/*
+* find the first line break in a piece of text: \n, \r or \r\n, since
+* terminals paste newlines as \r
+* returns: its index, or len if there is none; *brk is set to its length
+*/
+size_t find_line_break(const char *s, size_t len, size_t *brk)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\n' || s[i] == '\r') {
+            *brk = (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') ? 2 : 1;
+            return i;
+        }
+    }
+    *brk = 0;
+    return len;
+}
+
+/* record the insertion of a block of text, with its line breaks as \n */
+void undo_record_text(int flags, char *s, size_t len)
+{
+    if (E.buf->undo.replaying || len == 0) return;
+    char *text = malloc(len);
+    if (text == NULL) display_error("malloc");
+    size_t n = 0;
+    size_t brk;
+    size_t end;
+    while ((end = find_line_break(s, len, &brk)) < len) {
+        memcpy(text + n, s, end);
+        n += end;
+        text[n++] = '\n';
+        s += end + brk;
+        len -= end + brk;
+    }
+    memcpy(text + n, s, len);
+    n += len;
+    undo_record(UNDO_INSERT, flags, E.win->cursor_y, E.win->cursor_x, text, n);
+    free(text);
+}
+
+/* insert a block of text at the cursor, splitting it into rows in one pass */
+void insert_text(char *s, size_t len)
+{
+    if (editor_read_only()) return;
+
+    int flags = 0;
+    if (E.win->cursor_y == E.buf->num_rows) {
+        undo_record(UNDO_ADD_ROW, 0, E.win->cursor_y, 0, NULL, 0);
+        editor_insert_row(E.buf->num_rows, "", 0);
+        flags = UNDO_GROUP;
+    }
+    undo_record_text(flags, s, len);
+
+    size_t brk;
+    size_t end = find_line_break(s, len, &brk);
+    ERow *row = row_at(E.win->cursor_y);
+    if (end == len) {
+        row_insert_string(row, E.win->cursor_x, s, len);
+        E.win->cursor_x += len;
+        return;
+    }
+
+    /* the text right of the cursor ends up after the last inserted line */
+    size_t tail_len = row->size - E.win->cursor_x;
+    char *tail = malloc(tail_len + 1);
+    if (tail == NULL) display_error("malloc");
+    memcpy(tail, &row->chars[E.win->cursor_x], tail_len);
+    row_truncate(row, E.win->cursor_x);
+    row_append_string(row, s, end);
+
+    int at = E.win->cursor_y + 1;
+    s += end + brk;
+    len -= end + brk;
+    while ((end = find_line_break(s, len, &brk)) < len) {
+        editor_insert_row(at++, s, end);
+        s += end + brk;
+        len -= end + brk;
+    }
+    editor_insert_row(at, s, len);
+    row_append_string(row_at(at), tail, tail_len);
+    free(tail);
+
+    E.win->cursor_y = at;
+    E.win->cursor_x = len;
+}
+
+/* delete the character to the left of the cursor */
+void delete_char(void)
+{
+    if (editor_read_only()) return;
+
+    if (E.win->cursor_y == E.buf->num_rows) return;
+    if (E.win->cursor_x == 0 && E.win->cursor_y == 0) return;
+
+    ERow *row = row_at(E.win->cursor_y);
+    if (E.win->cursor_x > 0) {
+        /* a character with its combining marks goes at once */
+        int at = row_prev_char(row, E.win->cursor_x);
+        undo_record(UNDO_DELETE, 0, E.win->cursor_y, at, &row->chars[at], E.win->cursor_x - at);
+        row_delete_string(row, at, E.win->cursor_x - at);
+        E.win->cursor_x = at;
+    }
+    else {
+        ERow *prev = row_at(E.win->cursor_y - 1);
+        undo_record(UNDO_DELETE, 0, E.win->cursor_y - 1, prev->size, "\n", 1);
+        E.win->cursor_x = prev->size;
+        row_append_string(prev, row->chars, row->size);
+        delete_row(E.win->cursor_y);
+        E.win->cursor_y--;
+    }
+}
+
+/* delete len bytes of text starting at y, x, where each \n joins two rows */
+void delete_text(int y, int x, int len)
+{
+    ERow *row = row_at(y);
+    if (x + len <= row->size) {
+        row_delete_string(row, x, len);
+        return;
+    }
+
+    /* find the row and column where the deleted text ends */
+    int last = y;
+    int col = x;
+    int left = len;
+    while (left > row_at(last)->size - col) {
+        left -= row_at(last)->size - col + 1;
+        last++;
+        col = 0;
+    }
+    col += left;
+
+    ERow *end = row_at(last);
+    row_truncate(row, x);
+    row_append_string(row_at(y), &end->chars[col], end->size - col);
+    while (last-- > y) {
+        delete_row(y + 1);
+    }
+}
+
+/* apply a record or its inverse, leaving the cursor where the change is */
+void undo_apply(struct UndoRecord *rec, int invert)
+{
+    int type = rec->type;
+    if (invert && type == UNDO_INSERT) type = UNDO_DELETE;
+    else if (invert && type == UNDO_DELETE) type = UNDO_INSERT;
+
+    E.win->cursor_y = rec->y;
+    E.win->cursor_x = rec->x;
+    switch (type) {
+        case UNDO_INSERT:
+            insert_text((char *)(rec + 1), rec->len);
+            if (invert) {
+                E.win->cursor_y = rec->y;
+                E.win->cursor_x = rec->x;
+            }
+            break;
+        case UNDO_DELETE:
+            delete_text(rec->y, rec->x, rec->len);
+            break;
+        case UNDO_ADD_ROW:
+            if (invert) delete_row(rec->y);
+            else editor_insert_row(rec->y, "", 0);
+            E.win->cursor_x = 0;
+            break;
+        case UNDO_REPLACE: {
+            char *text = (char *)(rec + 1);
+            if (invert) row_set_text(row_at(rec->y), text, rec->x);
+            else row_set_text(row_at(rec->y), text + rec->x, rec->len - rec->x);
+            E.win->cursor_x = 0;
+            break;
+        }
+    }
+}
+
+/* undo the last edit, with the records grouped with it */
+void editor_undo(void)
+{
+    if (editor_read_only()) return;
+
+    struct Undo *u = &E.buf->undo;
+    if (u->pos == 0) {
+        set_status_message("Nothing to undo");
+        return;
+    }
+
+    u->replaying = 1;
+    struct UndoRecord *rec;
+    do {
+        rec = (struct UndoRecord *)(u->log + u->pos - u->last_size);
+        undo_apply(rec, 1);
+        u->pos -= rec->size;
+        u->last_size = rec->prev;
+    } while (rec->flags & UNDO_GROUP && u->pos > 0);
+    u->replaying = 0;
+    u->sealed = 1;
+}
+
+/* redo the last undone edit, with the records grouped with it */
+void editor_redo(void)
+{
+    if (editor_read_only()) return;
+
+    struct Undo *u = &E.buf->undo;
+    if (u->pos == u->end) {
+        set_status_message("Nothing to redo");
+        return;
+    }
+
+    u->replaying = 1;
+    do {
+        struct UndoRecord *rec = (struct UndoRecord *)(u->log + u->pos);
+        undo_apply(rec, 0);
+        u->pos += rec->size;
+        u->last_size = rec->size;
+    } while (u->pos < u->end && ((struct UndoRecord *)(u->log + u->pos))->flags & UNDO_GROUP);
+    u->replaying = 0;
+    u->sealed = 1;
+}
+
+/*
+* write the rows of a save snapshot to fd, in writev batches of SAVE_BATCH
+* rows pointing straight at the row text
+* returns: bytes written, or -1 on error
+*/
+long long rows_write(int fd, struct iovec *rows, int num_rows)
+{
+    struct iovec iov[SAVE_BATCH * 2];
+    long long total = 0;
+    int i = 0;
+
+    while (i < num_rows) {
+        int n = 0;
+        for (; i < num_rows && n < SAVE_BATCH * 2; i++) {
+            iov[n++] = rows[i];
+            iov[n].iov_base = "\n";
+            iov[n++].iov_len = 1;
+        }
+
+        struct iovec *v = iov;
+        while (n > 0) {
+            ssize_t nwritten = writev(fd, v, n);
+            if (nwritten == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            total += nwritten;
+            /* skip what went out, a short write can stop inside a row */
+            while (n > 0 && (size_t)nwritten >= v->iov_len) {
+                nwritten -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0) {
+                v->iov_base = (char *)v->iov_base + nwritten;
+                v->iov_len -= nwritten;
+            }
+        }
+    }
+    return total;
+}
+
+/* make a rename in the directory of path durable */
+void sync_parent_dir(const char *path)
+{
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/*
+* map a file read-only and index only the first screen of it,
+* the rest is split into rows on demand and while idle
+* returns: 0 on success, -1 on error
+*/
+int editor_open_mapped(char *filename, size_t len)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    E.buf->map = map;
+    E.buf->map_len = len;
+    E.buf->map_scan = 0;
+    index_cache_load();
+    rows_ensure(E.win->height);
+    return 0;
+}
+
+/* open and read a file from disk */
+void editor_open(char *filename)
+{
+    free(E.buf->filename);
+    E.buf->filename = strdup(filename);
+    editor_select_syntax();
+
+    struct stat st;
+    int regular = stat(filename, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular) {
+        E.buf->dev = st.st_dev;
+        E.buf->ino = st.st_ino;
+        E.buf->map_mtime = st.st_mtim;
+    }
+    /* a followed log may be truncated under a mapping, it is always read */
+    if (regular && st.st_size >= MMAP_MIN_SIZE && !E.buf->follow) {
+        if (editor_open_mapped(filename, st.st_size) == 0) {
+            E.buf->dirty = 0;
+            return;
+        }
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        display_error("open");
+    }
+
+    /* read the first screen now, the rest in big chunks from the event loop */
+    E.buf->load_fd = fd;
+    E.buf->load_cap = READ_CHUNK;
+    E.buf->load_buf = malloc(E.buf->load_cap);
+    E.buf->load_len = 0;
+    E.buf->load_read = 0;
+    E.buf->load_size = regular ? st.st_size : 0;
+    rows_ensure(E.win->height);
+    E.buf->dirty = 0;
+}
+
+/*
+* build the name of the swap file autosaves go to, .name.swp next to path
+* returns: malloc'd path
+*/
+char *swap_path(const char *path)
+{
+    return sidecar_path(path, "swp");
+}
+
+/*
+* write a save snapshot to a temp file next to the target and rename it
+* over, so a failed save leaves the old file intact; runs on the save
+* thread and touches nothing but the job
+*/
+void save_write(struct SaveJob *job)
+{
+    size_t tmp_size = strlen(job->path) + 8;
+    char *tmp = malloc(tmp_size);
+    if (tmp == NULL) {
+        /* fail the save, the save thread cannot take the editor down */
+        job->len = -1;
+        job->err = ENOMEM;
+        return;
+    }
+    snprintf(tmp, tmp_size, "%s.XXXXXX", job->path);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    job->len = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1) {
+        fchmod(fd, job->mode);
+        job->len = rows_write(fd, job->rows, job->num_rows);
+        if (job->len != -1 && fsync(fd) == -1) job->len = -1;
+        if (close(fd) == -1) job->len = -1;
+        if (job->len != -1 && rename(tmp, job->path) == -1) job->len = -1;
+    }
+    job->err = errno;
+    if (job->len == -1) {
+        unlink(tmp);
+    }
+    else {
+        sync_parent_dir(job->path);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    free(tmp);
+}
+
+/* body of the save thread, wakes the event loop ('v') when done */
+void *save_thread(void *arg)
+{
+    struct SaveJob *job = arg;
+    save_write(job);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    write(E.wake_pipe[1], "v", 1);
+    return NULL;
+}
+
+/*
+* snapshot the rows for a save: only pointers to the text are copied,
+* rows that own their text are marked shared so edits copy it first
+*/
+void save_snapshot(struct SaveJob *job)
+{
+    /* a mapped file has to be indexed to the end before it can be written */
+    rows_ensure(INT_MAX);
+
+    job->rows = malloc(sizeof(struct iovec) * (E.buf->num_rows ? E.buf->num_rows : 1));
+    if (job->rows == NULL) display_error("malloc");
+    job->num_rows = E.buf->num_rows;
+    job->dirty = E.buf->dirty;
+
+    RowIter it;
+    ERow *row;
+    int i = 0;
+    for (row = row_iter_start(&it, 0); row; row = row_iter_next(&it), i++) {
+        job->rows[i].iov_base = row->chars;
+        job->rows[i].iov_len = row->size;
+        if (!(row->flags & ROW_MAPPED)) row->flags |= ROW_SHARED;
+    }
+}
+
+/* the snapshot is written: rows own their text again, free what was replaced */
+void save_release(void)
+{
+    RowIter it;
+    ERow *row;
+    for (row = row_iter_start(&it, 0); row; row = row_iter_next(&it)) {
+        row->flags &= ~ROW_SHARED;
+    }
+
+    int i;
+    for (i = 0; i < E.buf->num_orphans; i++) {
+        text_free(E.buf->orphans[i].iov_base, E.buf->orphans[i].iov_len);
+    }
+    E.buf->num_orphans = 0;
+}
+
+/* wait for the running save and report how it went */
+void save_finish(void)
+{
+    struct SaveJob *job = E.buf->save;
+    if (job == NULL) return;
+
+    if (job->threaded) pthread_join(job->thread, NULL);
+    E.buf->save = NULL;
+    save_release();
+    /* writing read all of a mapped file */
+    map_trim(0, SIZE_MAX);
+
+    if (job->swap) {
+        /* failed autosaves are retried on the next timer */
+        if (job->len != -1) E.buf->autosave_dirty = job->dirty;
+    }
+    else if (job->len != -1) {
+        E.buf->dirty -= job->dirty;
+        E.buf->autosave_dirty = 0;
+        /* the rename put a new file in place, opening it again has to find this buffer */
+        struct stat st;
+        if (stat(job->path, &st) == 0) {
+            E.buf->dev = st.st_dev;
+            E.buf->ino = st.st_ino;
+        }
+        char *swap = swap_path(job->path);
+        unlink(swap);
+        free(swap);
+        set_status_message("%lld bytes written to disk (%.1f MB/s)", job->len,
+                job->secs > 0 ? job->len / job->secs / 1e6 : 0.0);
+    }
+    else {
+        set_status_message("Can't save file! I/O error: %s", strerror(job->err));
+    }
+
+    free(job->rows);
+    free(job->path);
+    free(job);
+
+    if (E.buf->save_again) {
+        E.buf->save_again = 0;
+        editor_save();
+    }
+}
+
+/* save threads finished: collect them and show the results */
+void save_collect(void)
+{
+    struct Buffer *cur = E.buf;
+    int collected = 0;
+    int i;
+    for (i = 0; i < E.num_buffers; i++) {
+        struct SaveJob *job = E.buffers[i]->save;
+        if (job == NULL || !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) continue;
+        E.buf = E.buffers[i];
+        save_finish();
+        collected = 1;
+    }
+    E.buf = cur;
+    if (collected) refresh_screen();
+}
+
+/* start writing the rows to path (or its swap file) in the background */
+void save_start(int swap)
+{
+    struct SaveJob *job = calloc(1, sizeof(struct SaveJob));
+    if (job == NULL) display_error("calloc");
+
+    /* resolve symlinks, so the link is kept and its target replaced */
+    char *path = realpath(E.buf->filename, NULL);
+    if (path == NULL) path = strdup(E.buf->filename);
+    job->swap = swap;
+
+    /*
+    * both saves and swaps copy the permissions of the file; a new file
+    * gets what open would give it under the umask, a swap stays 0600
+    */
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        job->mode = st.st_mode & 07777;
+    }
+    else if (swap) {
+        job->mode = 0600;
+    }
+    else {
+        mode_t mask = umask(0);
+        umask(mask);
+        job->mode = 0666 & ~mask;
+    }
+    job->path = swap ? swap_path(path) : path;
+    if (swap) free(path);
+
+    save_snapshot(job);
+    E.buf->save = job;
+    E.autosave_time = time(NULL);
+    job->threaded = pthread_create(&job->thread, NULL, save_thread, job) == 0;
+    if (!job->threaded) {
+        /* no thread: save in the foreground */
+        save_write(job);
+        save_finish();
+    }
+}
+
+/* save a file to disk */
+void editor_save(void)
+{
+    if (editor_read_only()) return;
+
+    if (E.buf->filename == NULL) {
+        E.buf->filename = editor_prompt("Save as: %s", NULL);
+        if (E.buf->filename == NULL) {
+            set_status_message("Save aborted");
+            return;
+        }
+        editor_select_syntax();
+    }
+
+    if (E.buf->save) {
+        /* save again once the running save (or autosave) is done */
+        E.buf->save_again = 1;
+        return;
+    }
+    save_start(0);
+}
+
+/*
+* check whether a buffer has changes its swap file does not have yet
+* returns: 1 if so, 0 otherwise
+*/
+int buffer_autosave_due(struct Buffer *b)
+{
+    return b->filename && b->dirty && b->dirty != b->autosave_dirty;
+}
+
+/* write the swap file of every buffer with changes it does not have yet */
+void editor_autosave(void)
 {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+    struct Buffer *cur = E.buf;
+    int i;
+    E.autosave_time = time(NULL);
+    for (i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        if (buffer_autosave_due(E.buf) && E.buf->save == NULL) {
+            save_start(1);
+        }
     }
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
-    E.dirty++;
+    E.buf = cur;
 }
 
-/* append a string to a row */
-void row_append_string(ERow *row, char *s, size_t len)
+/* drop the swap file of the current buffer */
+void swap_remove(void)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    E.dirty++;
+    if (E.buf->filename) {
+        char *path = realpath(E.buf->filename, NULL);
+        char *swap = swap_path(path ? path : E.buf->filename);
+        unlink(swap);
+        free(swap);
+        free(path);
+    }
 }
 
-/* delete a character from a row at a given index */
-void row_delete_char(ERow *row, int at)
+/* wait for the running saves and drop the swap files before exiting */
+void editor_quit(void)
 {
-    if (at < 0 || at > row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
+    int i;
+    for (i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        E.buf->save_again = 0;
+        save_finish();
+        swap_remove();
+    }
+    perf_write_trace();
 }
 
-/* insert a character into the position of the cursor */
-void insert_char(int c)
+/* quit, clearing the screen on the way out */
+void editor_exit(void)
 {
-    if (E.cursor_y == E.num_rows) {
-        editor_insert_row(E.num_rows, "", 0);
+    editor_quit();
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+}
+
+/*
+* find the first occurrence of needle in hay, memchr is enough for a single
+* byte and glibc's memmem runs Two-Way behind a vectorized first-byte scan
+* returns: pointer to the match, or NULL
+*/
+char *find_substr(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m == 1) return memchr(hay, needle[0], n);
+    return memmem(hay, n, needle, m);
+}
+
+/*
+* find the first match of the query in s[from, len), with one of the
+* compiled patterns when it is a regex and as a plain string otherwise;
+* rows need not end in a NUL, REG_STARTEND bounds the match
+* returns: start of the match, or -1, with its length in *mlen
+*/
+int search_match(regex_t *re, const char *s, int len, int from, int *mlen)
+{
+    struct Search *sr = &E.search;
+    if (re == NULL) {
+        char *match = find_substr(s + from, len - from, sr->query, sr->qlen);
+        *mlen = sr->qlen;
+        return match ? match - s : -1;
     }
-    row_insert_char(&E.rows[E.cursor_y], E.cursor_x, c);
-    E.cursor_x++;
+    regmatch_t m[1];
+    m[0].rm_so = from;
+    m[0].rm_eo = len;
+    if (regexec(re, s, 1, m, REG_STARTEND) != 0) return -1;
+    *mlen = m[0].rm_eo - m[0].rm_so;
+    return m[0].rm_so;
 }
 
-/* insert a newline */
-void insert_newline(void)
+/*
+* get the pattern a thread matches with, 0 for the editor and 1 on for
+* the workers
+* returns: the pattern, or NULL for a plain string search
+*/
+regex_t *search_pattern(int k)
 {
-    if (E.cursor_x == 0) {
-        editor_insert_row(E.cursor_y, "", 0);
+    return E.search.regex ? &E.search.patterns[k] : NULL;
+}
+
+/*
+* find the occurrence of the query in the row closest to col, the first one
+* starting at or after col when dir is 1, the last one before col otherwise
+* returns: column of the match, or -1
+*/
+int search_in_row(ERow *row, int col, int dir)
+{
+    int found = -1;
+    int from = dir == 1 ? col : 0;
+    int cx, mlen;
+
+    if (from < 0) from = 0;
+    while (from <= row->size &&
+            (cx = search_match(search_pattern(0), row->chars, row->size, from, &mlen)) != -1) {
+        if (dir == 1) return cx;
+        if (cx >= col) break;
+        found = cx;
+        from = cx + 1;
     }
-    else {
-        ERow *row = &E.rows[E.cursor_y];
-        editor_insert_row(E.cursor_y + 1, &row->chars[E.cursor_x], row->size - E.cursor_x);
-        row = &E.rows[E.cursor_y];
-        row->size = E.cursor_x;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
-    }    
-    E.cursor_y++;
-    E.cursor_x = 0;
+    return found;
 }
 
-/* delete the character to the left of the cursor */
-void delete_char(void)
+/* append the rows of a finished chunk to the merged results */
+void search_add_rows(int *rows, int count)
 {
-    if (E.cursor_y == E.num_rows) return;
-    if (E.cursor_x == 0 && E.cursor_y == 0) return;
+    struct Search *sr = &E.search;
+    if (count == 0) return;
+    if (sr->count + count > sr->cap) {
+        while (sr->count + count > sr->cap) {
+            sr->cap = sr->cap ? sr->cap * 2 : 1024;
+        }
+        sr->rows = realloc(sr->rows, sizeof(int) * sr->cap);
+        if (sr->rows == NULL) display_error("realloc");
+    }
+    memcpy(&sr->rows[sr->count], rows, sizeof(int) * count);
+    sr->count += count;
+}
 
-    ERow *row = &E.rows[E.cursor_y];
-    if (E.cursor_x > 0) {
-        row_delete_char(row, E.cursor_x - 1);
-        E.cursor_x--;
+/* note a matching row in a chunk */
+void search_chunk_add(struct SearchChunk *chunk, int *cap, int idx)
+{
+    if (chunk->count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        chunk->rows = realloc(chunk->rows, sizeof(int) * *cap);
+        if (chunk->rows == NULL) display_error("realloc");
     }
-    else {
-        E.cursor_x = E.rows[E.cursor_y - 1].size;
-        row_append_string(&E.rows[E.cursor_y - 1], row->chars, row->size);
-        delete_row(E.cursor_y);
-        E.cursor_y--;
+    chunk->rows[chunk->count++] = idx;
+}
+
+/* add bytes to the text a replacement builds */
+void replace_put(char **buf, size_t *cap, size_t *len, const char *s, size_t n)
+{
+    if (n == 0) return;
+    if (*len + n > *cap) {
+        while (*len + n > *cap) {
+            *cap = *cap ? *cap * 2 : 128;
+        }
+        *buf = realloc(*buf, *cap);
+        if (*buf == NULL) display_error("realloc");
     }
+    memcpy(*buf + *len, s, n);
+    *len += n;
 }
 
-/* convert rows to a single string */
-char *rows_to_string(int *buflen)
+/*
+* build the text of a row with every match of the pattern replaced by the
+* replacement, where \0 to \9 stand for the match and its groups; an empty
+* match right after another match is skipped, as sed does, and so is one
+* inside a character since the pattern matches bytes
+* returns: the new text, or NULL when nothing matched, with its length in
+* *len and the matches added to *matches
+*/
+char *replace_row(regex_t *re, ERow *row, int *len, long *matches)
 {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.num_rows; j++) {
-        totlen += E.rows[j].rsize + 1;
+    struct Search *sr = &E.search;
+    regmatch_t m[10];
+    char *out = NULL;
+    size_t cap = 0, olen = 0;
+    int pos = 0, copied = 0, prev = -1;
+    long n = 0;
+
+    while (pos <= row->size) {
+        m[0].rm_so = pos;
+        m[0].rm_eo = row->size;
+        if (regexec(re, row->chars, sr->groups, m, REG_STARTEND) != 0) break;
+        int so = m[0].rm_so, eo = m[0].rm_eo;
+        pos = eo;
+        if (so == eo) {
+            while (++pos < row->size && (row->chars[pos] & 0xc0) == 0x80);
+            if (so == prev || (so < row->size && (row->chars[so] & 0xc0) == 0x80)) continue;
+        }
+
+        replace_put(&out, &cap, &olen, row->chars + copied, so - copied);
+        const char *w = sr->with;
+        while (*w) {
+            if (w[0] == '\\' && w[1] >= '0' && w[1] <= '9') {
+                regmatch_t *g = &m[w[1] - '0'];
+                if (w[1] - '0' < sr->groups && g->rm_so != -1) replace_put(&out, &cap, &olen, row->chars + g->rm_so, g->rm_eo - g->rm_so);
+                w += 2;
+                continue;
+            }
+            if (w[0] == '\\' && (w[1] == '\\' || w[1] == '/')) w++;
+            replace_put(&out, &cap, &olen, w++, 1);
+        }
+        copied = eo;
+        prev = eo;
+        n++;
     }
-    *buflen = totlen;
+    if (n == 0) return NULL;
+    replace_put(&out, &cap, &olen, row->chars + copied, row->size - copied);
+    if (olen > INT_MAX - 1) {
+        free(out);
+        return NULL;
+    }
+    *len = olen;
+    *matches += n;
+    return out;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.num_rows; j++) {
-        memcpy(p, E.rows[j].chars, E.rows[j].size);
-        p += E.rows[j].size;
-        *p = '\n';
-        p++;
+/* note a matching row in a chunk, with its replaced text for a replace-all */
+void replace_chunk_add(struct SearchChunk *chunk, int *cap, int idx, char *text, int len)
+{
+    int old = *cap;
+    search_chunk_add(chunk, cap, idx);
+    if (*cap != old) {
+        chunk->texts = realloc(chunk->texts, sizeof(char *) * *cap);
+        chunk->lens = realloc(chunk->lens, sizeof(int) * *cap);
+        if (chunk->texts == NULL || chunk->lens == NULL) display_error("realloc");
     }
+    chunk->texts[chunk->count - 1] = text;
+    chunk->lens[chunk->count - 1] = len;
+}
 
-    return buf;
+/*
+* check one row for the running search, or build its replaced text
+* for a replace-all
+* returns: 1 if it matched, 0 otherwise
+*/
+int search_scan_row(struct SearchChunk *chunk, int *cap, regex_t *re, ERow *row, int idx)
+{
+    struct Search *sr = &E.search;
+    int mlen;
+    if (sr->with) {
+        int len;
+        char *text = replace_row(re, row, &len, &chunk->matches);
+        if (text) replace_chunk_add(chunk, cap, idx, text, len);
+        return text != NULL;
+    }
+    if (search_match(re, row->chars, row->size, 0, &mlen) == -1) return 0;
+    search_chunk_add(chunk, cap, idx);
+    return 1;
 }
 
-/* open and read a file from disk */
-void editor_open(char *filename)
+/* scan one chunk of the running search with a worker's pattern, called without the lock held */
+void search_scan_chunk(struct SearchChunk *chunk, int lo, int hi, regex_t *re)
 {
-    free(E.filename);
-    E.filename = strdup(filename);
+    struct Search *sr = &E.search;
+    int cap = 0;
+    int i;
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        display_error("fopen");
+    if (sr->source) {
+        for (i = lo; i < hi; i++) {
+            if ((i & 1023) == 0 && __atomic_load_n(&sr->cancel, __ATOMIC_RELAXED)) return;
+            search_scan_row(chunk, &cap, re, buffer_row_at(sr->buf, sr->source[i]), sr->source[i]);
+        }
+        return;
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            linelen--;
+    RowIter it;
+    ERow *row = buffer_iter_start(sr->buf, &it, lo);
+    for (i = lo; i < hi && row; i++, row = row_iter_next(&it)) {
+        if ((i & 1023) == 0 && __atomic_load_n(&sr->cancel, __ATOMIC_RELAXED)) return;
+        search_scan_row(chunk, &cap, re, row, i);
+    }
+}
+
+/*
+* search worker: claims chunks in order and scans them, the rows are not
+* modified while the search prompt is open so they are read without locking
+*/
+void *search_worker(void *arg)
+{
+    struct Search *sr = &E.search;
+    int k = (intptr_t)arg;
+
+    pthread_mutex_lock(&sr->lock);
+    while (1) {
+        while (sr->cancel || sr->next_chunk == sr->num_chunks) {
+            pthread_cond_wait(&sr->wake, &sr->lock);
+        }
+        int c = sr->next_chunk++;
+        struct SearchChunk *chunk = &sr->chunks[c];
+        int lo = c * SEARCH_CHUNK_ROWS;
+        int hi = lo + SEARCH_CHUNK_ROWS;
+        if (hi > sr->source_count) hi = sr->source_count;
+        sr->busy++;
+        pthread_mutex_unlock(&sr->lock);
+
+        search_scan_chunk(chunk, lo, hi, search_pattern(k));
+
+        pthread_mutex_lock(&sr->lock);
+        sr->busy--;
+        if (!sr->cancel) {
+            chunk->done = 1;
+            sr->done++;
+            sr->found += chunk->count;
+            if (!sr->notified) {
+                sr->notified = 1;
+                write(E.wake_pipe[1], "s", 1);
+            }
         }
-        editor_insert_row(E.num_rows, line, linelen);
+        if (sr->busy == 0) pthread_cond_signal(&sr->idle);
     }
+    return NULL;
+}
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+/* start the worker threads, one per CPU */
+void search_init_workers(void)
+{
+    struct Search *sr = &E.search;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > SEARCH_MAX_WORKERS) cpus = SEARCH_MAX_WORKERS;
+
+    pthread_mutex_init(&sr->lock, NULL);
+    pthread_cond_init(&sr->wake, NULL);
+    pthread_cond_init(&sr->idle, NULL);
+    while (sr->num_workers < cpus) {
+        pthread_t *t = &sr->workers[sr->num_workers];
+        /* worker i matches with pattern i + 1 */
+        if (pthread_create(t, NULL, search_worker, (void *)(intptr_t)(sr->num_workers + 1)) != 0) {
+            if (sr->num_workers == 0) display_error("pthread_create");
+            break;
+        }
+        pthread_detach(*t);
+        sr->num_workers++;
+    }
 }
 
-/* save a file to disk */
-void editor_save(void)
+/* stop the running scan and wait until no worker looks at it anymore */
+void search_cancel(void)
 {
-    if (E.filename == NULL) {
-        E.filename = editor_prompt("Save as: %s", NULL);
-        if (E.filename == NULL) {
-            set_status_message("Save aborted");
-            return;
+    struct Search *sr = &E.search;
+    if (sr->num_workers == 0) return;
+
+    pthread_mutex_lock(&sr->lock);
+    __atomic_store_n(&sr->cancel, 1, __ATOMIC_RELAXED);
+    while (sr->busy > 0) {
+        pthread_cond_wait(&sr->idle, &sr->lock);
+    }
+    int i, j;
+    for (i = 0; i < sr->num_chunks; i++) {
+        struct SearchChunk *chunk = &sr->chunks[i];
+        for (j = 0; chunk->texts && j < chunk->count; j++) {
+            free(chunk->texts[j]);
         }
+        free(chunk->texts);
+        free(chunk->lens);
+        free(chunk->rows);
     }
+    free(sr->chunks);
+    free(sr->source);
+    sr->chunks = NULL;
+    sr->source = NULL;
+    sr->num_chunks = 0;
+    sr->next_chunk = 0;
+    sr->merged = 0;
+    sr->done = 0;
+    sr->found = 0;
+    __atomic_store_n(&sr->cancel, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sr->lock);
+}
 
-    int len;
-    char *buf = rows_to_string(&len);
+/* hand the source rows to the workers in chunks */
+void search_start(void)
+{
+    struct Search *sr = &E.search;
+    if (sr->num_workers == 0) search_init_workers();
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                set_status_message("%d bytes written to disk", len);
-                return;
-            }
+    pthread_mutex_lock(&sr->lock);
+    sr->num_chunks = (sr->source_count + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+    sr->chunks = calloc(sr->num_chunks ? sr->num_chunks : 1, sizeof(struct SearchChunk));
+    if (sr->chunks == NULL) display_error("calloc");
+    sr->complete = sr->num_chunks == 0;
+    pthread_cond_broadcast(&sr->wake);
+    pthread_mutex_unlock(&sr->lock);
+}
+
+/* free the compiled patterns of the query */
+void search_uncompile(void)
+{
+    struct Search *sr = &E.search;
+    while (sr->compiled > 0) {
+        regfree(&sr->patterns[--sr->compiled]);
+    }
+}
+
+/*
+* compile the query as a regex for the editor and for every worker, the
+* workers are not inside a chunk
+* returns: 1 if it is a valid pattern, 0 otherwise
+*/
+int search_compile(void)
+{
+    struct Search *sr = &E.search;
+    search_uncompile();
+    if (sr->num_workers == 0) search_init_workers();
+    while (sr->compiled <= sr->num_workers) {
+        if (regcomp(&sr->patterns[sr->compiled], sr->query, REG_EXTENDED) != 0) {
+            search_uncompile();
+            return 0;
         }
-        close(fd);
+        sr->compiled++;
+    }
+    return 1;
+}
+
+/*
+* start collecting the rows containing query, narrowing the previous
+* results when they were collected for a substring of query; a longer
+* regex need not match less, so those are always scanned in full
+*/
+void search_update(const char *query)
+{
+    struct Search *sr = &E.search;
+    int narrow = !sr->regex && sr->complete && sr->qlen && strstr(query, sr->query);
+
+    search_cancel();
+    free(sr->query);
+    sr->query = strdup(query);
+    if (sr->query == NULL) display_error("strdup");
+    sr->qlen = strlen(query);
+    sr->match_row = -1;
+    sr->complete = 0;
+    sr->buf = E.buf;
+
+    if (narrow) {
+        sr->source = sr->rows;
+        sr->source_count = sr->count;
+        sr->rows = NULL;
+        sr->cap = 0;
+    }
+    else {
+        sr->source_count = E.buf->num_rows;
+    }
+    sr->count = 0;
+    if (sr->qlen == 0) return;
+    if (sr->regex && !search_compile()) {
+        /* nothing matches a broken pattern */
+        sr->complete = 1;
+        return;
+    }
+    search_start();
+}
+
+/*
+* find a candidate row after (dir 1) or before (dir -1) the row at, wrapping
+* around the file once the search is complete
+* returns: row index, or -1 when there is none (yet)
+*/
+int search_next_row(int at, int dir)
+{
+    struct Search *sr = &E.search;
+    if (sr->count == 0) return -1;
+
+    /* first candidate greater than at */
+    int lo = 0, hi = sr->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sr->rows[mid] <= at) lo = mid + 1;
+        else hi = mid;
+    }
+    if (dir == 1) {
+        if (lo < sr->count) return sr->rows[lo];
+        return sr->complete ? sr->rows[0] : -1;
+    }
+    if (lo > 0 && sr->rows[lo - 1] == at) lo--;
+    if (lo > 0) return sr->rows[lo - 1];
+    return sr->complete ? sr->rows[sr->count - 1] : -1;
+}
+
+/*
+* move to the match after (dir 1) or before (dir -1) the current one, or to
+* the first match of the file when there is no current match
+* returns: 1 if a match was found, 0 otherwise
+*/
+int search_step(int dir)
+{
+    struct Search *sr = &E.search;
+    int row_idx, col, i;
+
+    if (sr->qlen == 0) return 0;
+    if (sr->match_row == -1) {
+        row_idx = -1;
+        dir = 1;
+    }
+    else {
+        row_idx = sr->match_row;
+        col = dir == 1 ? sr->match_col + 1 : sr->match_col;
+        int found = search_in_row(row_at(row_idx), col, dir);
+        if (found != -1) {
+            sr->match_col = found;
+            return 1;
+        }
+    }
+
+    for (i = 0; i < E.buf->num_rows; i++) {
+        row_idx = search_next_row(row_idx, dir);
+        if (row_idx == -1) return 0;
+        ERow *row = row_at(row_idx);
+        int found = search_in_row(row, dir == 1 ? 0 : row->size + 1, dir);
+        if (found != -1) {
+            sr->match_row = row_idx;
+            sr->match_col = found;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* put the cursor on the current match */
+void search_jump(void)
+{
+    E.win->cursor_y = E.search.match_row;
+    E.win->cursor_x = E.search.match_col;
+    E.win->row_offset = E.buf->num_rows;
+}
+
+/*
+* let the mapped blocks go that the chunks merged since chunk from have been
+* scanned through, up to the block the next chunk starts in
+*/
+void search_trim(int from)
+{
+    struct Search *sr = &E.search;
+    if (!map_bounded() || sr->merged == from) return;
+    if (sr->complete) {
+        map_trim(0, SIZE_MAX);
+        return;
+    }
+    if (sr->source) return;
+
+    ERow *first = row_at(from * SEARCH_CHUNK_ROWS);
+    ERow *next = row_at(sr->merged * SEARCH_CHUNK_ROWS);
+    if ((first->flags & ROW_MAPPED) && (next->flags & ROW_MAPPED)) {
+        map_trim((first->chars - E.buf->map) / MAP_BLOCK_BYTES, (next->chars - E.buf->map) / MAP_BLOCK_BYTES);
+    }
+}
+
+/* merge the chunks the workers finished, in order, and show the results */
+void search_collect(void)
+{
+    struct Search *sr = &E.search;
+    if (sr->num_workers == 0) return;
+
+    pthread_mutex_lock(&sr->lock);
+    sr->notified = 0;
+    int merged = sr->merged;
+    while (sr->merged < sr->num_chunks && sr->chunks[sr->merged].done) {
+        struct SearchChunk *chunk = &sr->chunks[sr->merged++];
+        search_add_rows(chunk->rows, chunk->count);
+        free(chunk->rows);
+        chunk->rows = NULL;
+    }
+    if (sr->num_chunks && sr->merged == sr->num_chunks) {
+        sr->complete = 1;
+    }
+    pthread_mutex_unlock(&sr->lock);
+    search_trim(merged);
+
+    if (sr->match_row == -1 && search_step(1)) {
+        search_jump();
+    }
+    refresh_screen();
+}
+
+/*
+* describe the running search for the status bar
+* returns: length of the text written to buf
+*/
+int search_progress(char *buf, size_t size)
+{
+    struct Search *sr = &E.search;
+    pthread_mutex_lock(&sr->lock);
+    int found = sr->found;
+    int pct = sr->num_chunks ? (int)(100LL * sr->done / sr->num_chunks) : 100;
+    pthread_mutex_unlock(&sr->lock);
+
+    if (sr->regex && !sr->compiled) {
+        return snprintf(buf, size, "invalid regex");
     }
+    const char *kind = sr->regex ? "regex, " : "";
+    if (pct == 100) {
+        return snprintf(buf, size, "%s%d matching lines", kind, found);
+    }
+    return snprintf(buf, size, "%s%d matching lines, %d%%", kind, found, pct);
+}
 
-    free(buf);
-    set_status_message("Can't save file! I/O error: %s", strerror(errno));
+/* forget the last search */
+void search_reset(void)
+{
+    struct Search *sr = &E.search;
+    search_cancel();
+    search_uncompile();
+    free(sr->query);
+    free(sr->rows);
+    free(sr->with);
+    sr->query = NULL;
+    sr->with = NULL;
+    sr->regex = 0;
+    sr->qlen = 0;
+    sr->rows = NULL;
+    sr->count = 0;
+    sr->cap = 0;
+    sr->complete = 0;
+    sr->match_row = -1;
+    sr->active = 0;
 }
 
 /* callback for find */
 void find_callback(char *query, int key)
 {
-    static int last_match = -1;
-    static int direction = 1;
+    struct Search *sr = &E.search;
 
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
         return;
     }
     else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
+        if (!search_step(1)) return;
     }
     else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+        if (!search_step(-1)) return;
+    }
+    else if (key == CTRL_KEY('e')) {
+        /* switch between plain text and regex, scanning everything again */
+        sr->regex = !sr->regex;
+        sr->complete = 0;
+        search_update(query);
+        return;
     }
     else {
-        last_match = -1;
-        direction = 1;
+        if (sr->query && strcmp(query, sr->query) == 0) return;
+        search_update(query);
+        return;
     }
+    search_jump();
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.num_rows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = E.num_rows - 1;
+/* find a string in the file */
+void editor_find(void)
+{
+    int saved_cursor_x = E.win->cursor_x;
+    int saved_cursor_y = E.win->cursor_y;
+    int saved_col_offset = E.win->col_offset;
+    int saved_row_offset = E.win->row_offset;
+    int saved_wrap_skip = E.win->wrap_skip;
+
+    rows_ensure(INT_MAX);
+
+    search_reset();
+    E.search.active = 1;
+    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter, ^E regex)", find_callback);
+    search_reset();
+
+    if (query) {
+        free(query);
+    }
+    else {
+        E.win->cursor_x = saved_cursor_x;
+        E.win->cursor_y = saved_cursor_y;
+        E.win->col_offset = saved_col_offset;
+        E.win->row_offset = saved_row_offset;
+        E.win->wrap_skip = saved_wrap_skip;
+    }
+}
+
+/*
+* split a replace-all query at its first unescaped /, dropping the escapes
+* of slashes in the pattern; the replacement keeps its own for replace_row
+* returns: the replacement, inside query, or NULL without a /
+*/
+char *replace_split(char *query)
+{
+    char *r = query;
+    char *w = query;
+    while (*r) {
+        if (r[0] == '\\' && r[1] == '/') {
+            *w++ = '/';
+            r += 2;
+        }
+        else if (r[0] == '\\' && r[1]) {
+            *w++ = *r++;
+            *w++ = *r++;
+        }
+        else if (*r == '/') {
+            *w = '\0';
+            return r + 1;
+        }
+        else {
+            *w++ = *r++;
+        }
+    }
+    return NULL;
+}
+
+/*
+* look for ESC or ^C in the input while a replace-all runs, other keys
+* stay queued for after it
+* returns: 1 if the replace should stop
+*/
+int replace_cancel_key(void)
+{
+    if (!input_key_ready() && E.input.end > E.input.start && !E.pasting) {
+        /* a lone ESC: give the rest a moment to arrive, as read_keypress does */
+        struct pollfd fd = {E.input.fd, POLLIN, 0};
+        if (poll(&fd, 1, ESC_TIMEOUT_MS) <= 0 || !input_key_ready()) {
+            E.input.key = input_parse_key(1);
+        }
+    }
+    if (E.input.key != '\x1b' && E.input.key != CTRL_KEY('c')) return 0;
+    E.input.key = -1;
+    return 1;
+}
+
+/*
+* wait for the workers to go through every chunk of a replace-all,
+* stopping them on ESC or ^C
+* returns: 1 when every chunk is done, 0 if the replace was cancelled
+*/
+int replace_wait(void)
+{
+    struct Search *sr = &E.search;
+    while (1) {
+        pthread_mutex_lock(&sr->lock);
+        sr->notified = 0;
+        int done = sr->done;
+        int total = sr->num_chunks;
+        pthread_mutex_unlock(&sr->lock);
+        if (done == total) return 1;
+
+        set_status_message("Replacing... %d%% (ESC to cancel)", (int)(100LL * done / total));
+        refresh_screen();
+        /* a key already waiting is not ESC, leave the rest of the input be */
+        struct pollfd fds[2] = {
+            {E.wake_pipe[0], POLLIN, 0},
+            {E.input.key == -1 ? E.input.fd : -1, POLLIN, 0}
+        };
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            display_error("poll");
+        }
+        if (fds[1].revents && replace_cancel_key()) {
+            search_cancel();
+            return 0;
+        }
+        char buf[64];
+        int resized = 0, saved = 0;
+        int i, len;
+        while ((len = read(E.wake_pipe[0], buf, sizeof(buf))) > 0) {
+            for (i = 0; i < len; i++) {
+                if (buf[i] == 'w') resized = 1;
+                if (buf[i] == 'v') saved = 1;
+            }
+        }
+        if (resized) editor_resize();
+        if (saved) save_collect();
+    }
+}
+
+/*
+* apply what the workers built in one batch: every touched row gets its
+* new text in a single change, and all of them are one undo step; older
+* edits make room for it, and it is kept even when bigger than the log
+* returns: the number of matches replaced
+*/
+long replace_apply(void)
+{
+    struct Search *sr = &E.search;
+    long matches = 0;
+    int rows = 0;
+    size_t undo_bytes = 0;
+    int i, j;
+
+    for (i = 0; i < sr->num_chunks; i++) {
+        struct SearchChunk *chunk = &sr->chunks[i];
+        matches += chunk->matches;
+        rows += chunk->count;
+        for (j = 0; j < chunk->count; j++) {
+            undo_bytes += sizeof(struct UndoRecord) + 8 + row_at(chunk->rows[j])->size + chunk->lens[j];
+        }
+    }
+    if (matches == 0) {
+        set_status_message("No match for %.40s", sr->query);
+        return 0;
+    }
+
+    char *pair = NULL;
+    size_t pair_cap = 0;
+    int flags = 0;
+    undo_trim(undo_bytes < UNDO_MAX_BYTES ? UNDO_MAX_BYTES - undo_bytes : 0);
+    undo_seal();
+    for (i = 0; i < sr->num_chunks; i++) {
+        struct SearchChunk *chunk = &sr->chunks[i];
+        for (j = 0; j < chunk->count; j++) {
+            ERow *row = row_at(chunk->rows[j]);
+            /* the old text followed by the new one */
+            size_t need = row->size + chunk->lens[j];
+            if (need > pair_cap) {
+                pair_cap = need;
+                pair = realloc(pair, pair_cap);
+                if (pair == NULL) display_error("realloc");
+            }
+            memcpy(pair, row->chars, row->size);
+            memcpy(pair + row->size, chunk->texts[j], chunk->lens[j]);
+            undo_record(UNDO_REPLACE, flags, chunk->rows[j], row->size, pair, need);
+            flags = UNDO_GROUP;
+            row_set_text(row, chunk->texts[j], chunk->lens[j]);
+            free(chunk->texts[j]);
+            chunk->texts[j] = NULL;
+        }
+    }
+    free(pair);
+    undo_seal();
+
+    if (E.win->cursor_y < E.buf->num_rows && E.win->cursor_x > row_at(E.win->cursor_y)->size) {
+        E.win->cursor_x = row_at(E.win->cursor_y)->size;
+    }
+    set_status_message("Replaced %ld matches on %d lines", matches, rows);
+    return matches;
+}
+
+/*
+* replace every match of a regex in the buffer, the workers match the
+* rows and build their new text in chunks, then it all goes in at once
+* returns: the number of matches replaced
+*/
+long replace_all(const char *pattern, const char *with)
+{
+    struct Search *sr = &E.search;
+    long matches = 0;
+    rows_ensure(INT_MAX);
+    search_reset();
+    sr->regex = 1;
+    sr->with = strdup(with);
+    if (sr->with == NULL) display_error("strdup");
+    sr->groups = 1;
+    const char *w;
+    for (w = with; *w; w++) {
+        if (w[0] != '\\' || w[1] == '\0') continue;
+        w++;
+        if (*w >= '0' && *w <= '9' && *w - '0' + 1 > sr->groups) sr->groups = *w - '0' + 1;
+    }
+    search_update(pattern);
+    if (sr->compiled) {
+        if (replace_wait()) {
+            matches = replace_apply();
         }
-
-        ERow *row = &E.rows[current];
-        char *match = strstr(row->chars, query);
-        if (match) {
-            last_match = current;
-            E.cursor_y = current;
-            E.cursor_x = rx_to_cx(row, match - row->render);
-            E.row_offset = E.num_rows;
-            break;
+        else {
+            set_status_message("Replace cancelled, nothing changed");
         }
     }
+    else {
+        set_status_message("Invalid regex: %.40s", pattern);
+    }
+    search_reset();
+    return matches;
 }
 
-/* find a string in the file */
-void editor_find(void)
+/* ask for regex/replacement and replace every match */
+void editor_replace(void)
 {
-    int saved_cursor_x = E.cursor_x;
-    int saved_cursor_y = E.cursor_y;
-    int saved_col_offset = E.col_offset;
-    int saved_row_offset = E.row_offset;
+    if (editor_read_only()) return;
 
-    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", find_callback);
-    
-    if (query) {
-        free(query);
+    char *query = editor_prompt("Replace: %s (regex/replacement, ESC to cancel)", NULL);
+    if (query == NULL) return;
+    char *with = replace_split(query);
+    if (with == NULL || query[0] == '\0') {
+        set_status_message("Replace takes regex/replacement, \\/ for a slash");
     }
     else {
-        E.cursor_x = saved_cursor_x;
-        E.cursor_y = saved_cursor_y;
-        E.col_offset = saved_col_offset;
-        E.row_offset = saved_row_offset;
+        replace_all(query, with);
     }
+    free(query);
 }
 
-/* fill values in append buffer */
-void ab_append(struct AppendBuf *ab,  const char *s, int len)
+/* turn soft wrapping at a width on, or off with 0, and recount visual lines */
+void editor_set_wrap(int cols)
 {
-    char *new = realloc(ab->buf, ab->len + len);
-    if (new == NULL) {
-        return;
+    /* widths of stale rows are only kept up to date while wrapping */
+    int measure = E.buf->wrap_cols == 0;
+    E.buf->wrap_cols = cols;
+    int i;
+    for (i = 0; i < E.num_windows; i++) {
+        if (E.windows[i]->buf != E.buf) continue;
+        E.windows[i]->wrap_skip = 0;
+        E.windows[i]->col_offset = 0;
     }
-
-    memcpy(&new[ab->len], s, len);
-    ab->buf = new;
-    ab->len += len;
-}
-
-/* free append buffer */
-void ab_free(struct AppendBuf *ab)
-{
-    free(ab->buf);
+    rows_rebuild_lines(E.buf->rows.root, E.buf->rows.height, measure && cols);
 }
 
 /* prevent the cursor from going off the screen */
 void editor_scroll(void)
 {
-    E.rx = 0;
-    if (E.cursor_y < E.num_rows) {
-        E.rx = cx_to_rx(&E.rows[E.cursor_y], E.cursor_x);
+    /* keep a screen of rows indexed past the cursor and the viewport */
+    rows_ensure(E.win->cursor_y + E.win->height);
+    rows_ensure(E.win->row_offset + 2 * E.win->height);
+
+    E.win->rx = 0;
+    if (E.win->cursor_y < E.buf->num_rows) {
+        E.win->rx = cx_to_rx(row_at(E.win->cursor_y), E.win->cursor_x);
+    }
+
+    if (E.buf->wrap_cols) {
+        /* scroll by visual lines, the row at the top may start above the screen */
+        int top = row_line(E.win->row_offset);
+        if (E.win->row_offset < E.buf->num_rows && E.win->wrap_skip < row_lines(row_at(E.win->row_offset))) {
+            top += E.win->wrap_skip;
+        }
+        int sub = 0;
+        if (E.win->cursor_y < E.buf->num_rows) sub = row_sub_line(row_at(E.win->cursor_y), E.win->rx);
+        E.win->cursor_line = row_line(E.win->cursor_y) + sub;
+        if (E.win->cursor_line < top) {
+            top = E.win->cursor_line;
+        }
+        if (E.win->cursor_line >= top + E.win->height) {
+            top = E.win->cursor_line - E.win->height + 1;
+        }
+        E.win->row_offset = line_row(top, &E.win->wrap_skip);
+        E.win->line_offset = top;
+        /* the cursor column is counted from the start of its visual line */
+        E.win->col_offset = sub * E.buf->wrap_cols;
+        render_window_update();
+        return;
+    }
+
+    if (E.win->cursor_y < E.win->row_offset) {
+        E.win->row_offset = E.win->cursor_y;
+    }
+    if (E.win->cursor_y >= E.win->row_offset + E.win->height) {
+        E.win->row_offset = E.win->cursor_y - E.win->height + 1;
+    }
+    if (E.win->rx < E.win->col_offset) {
+        E.win->col_offset = E.win->rx;
+    }
+    if (E.win->rx >= E.win->col_offset + E.screen_cols) {
+        E.win->col_offset = E.win->rx - E.screen_cols + 1;
     }
+    E.win->cursor_line = E.win->cursor_y;
+    E.win->line_offset = E.win->row_offset;
+    render_window_update();
+}
 
-    if (E.cursor_y < E.row_offset) {
-        E.row_offset = E.cursor_y;
+/*
+* append render[from, to) of a row, sending a color escape only where the
+* color differs from *color, the one currently set on the terminal
+*/
+void draw_span(struct AppendBuf *ab, char *render, unsigned char *hl, int from, int to, int *color)
+{
+    if (hl == NULL) {
+        ab_append(ab, &render[from], to - from);
+        return;
     }
-    if (E.cursor_y >= E.row_offset + E.screen_rows) {
-        E.row_offset = E.cursor_y - E.screen_rows + 1;
+
+    int start = from;
+    int i;
+    for (i = from; i < to; i++) {
+        int c = syntax_to_color(hl[i]);
+        if (c != *color) {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", c);
+            ab_append(ab, &render[start], i - start);
+            ab_append(ab, buf, clen);
+            *color = c;
+            start = i;
+        }
     }
-    if (E.rx < E.col_offset) {
-        E.col_offset = E.rx;
+    ab_append(ab, &render[start], to - start);
+}
+
+/*
+* draw render indexes [from, to) of a row, with every search match in
+* reverse video; render holds the row from render index base on
+*/
+void draw_matches(struct AppendBuf *ab, ERow *row, char *render, int base, int from_rb, int to_rb, int *color)
+{
+    struct Search *sr = &E.search;
+    int pos = from_rb;
+    int end = to_rb;
+    int from = 0;
+    int skip = 0; /* matches ending before this chars index are left of the screen */
+    int cx, mlen;
+
+    if (row->flags & ROW_LONG) {
+        struct RowStep next;
+        skip = row_long_seek(row, 2, from_rb, &next).cx;
+        /* a plain match is qlen long, one starting further back cannot reach the screen */
+        if (!sr->regex && skip > sr->qlen) from = skip - sr->qlen;
     }
-    if (E.rx >= E.col_offset + E.screen_cols) {
-        E.col_offset = E.rx - E.screen_cols + 1;
+    while (pos < end && from <= row->size && (!sr->regex || sr->compiled) &&
+            (cx = search_match(search_pattern(0), row->chars, row->size, from, &mlen)) != -1) {
+        if (cx + mlen <= skip) {
+            from = mlen ? cx + mlen : cx + 1;
+            continue;
+        }
+        int rs = cx_to_rb(row, cx);
+        int re = cx_to_rb(row, cx + mlen);
+        /* an empty match has nothing to show, step past it */
+        from = mlen ? cx + mlen : cx + 1;
+        if (rs >= end) break;
+        if (re <= pos) continue;
+        if (rs < pos) rs = pos;
+        if (re > end) re = end;
+        draw_span(ab, render, row_hl(row), pos - base, rs - base, color);
+        ab_append(ab, "\x1b[7m", 4);
+        draw_span(ab, render, row_hl(row), rs - base, re - base, color);
+        ab_append(ab, "\x1b[27m", 5);
+        pos = re;
     }
+    draw_span(ab, render, row_hl(row), pos - base, end - base, color);
 }
 
 /* draw a column of tildes on the left side of the screen */
 void draw_rows(struct AppendBuf *ab)
 {
+    /* lexer states are only needed down to the bottom of the screen */
+    syntax_update(E.win->row_offset + E.win->height - 1);
+
+    RowIter it;
+    ERow *row = row_iter_start(&it, E.win->row_offset);
+    int sub = E.buf->wrap_cols ? E.win->wrap_skip : 0; /* visual line of row drawn next */
     int i;
-    for (i = 0; i < E.screen_rows; i++) {
-        int file_row = i + E.row_offset;
-        if (file_row >= E.num_rows) {
+    for (i = 0; i < E.win->height; i++) {
+        if (row == NULL) {
             /* display welcome message in the middle of the screen */
-            if (E.num_rows == 0 && i == E.screen_rows / 3) {
+            if (E.buf->num_rows == 0 && i == E.win->height / 3) {
                 char welcome[80];
                 int welcome_len = snprintf(welcome, sizeof(welcome),
                         "Welcome to the text editor! Press ^Q to quit.");
@@ -626,9 +5744,7 @@ void draw_rows(struct AppendBuf *ab)
                     ab_append(ab, "~", 1); /* tilde */
                     padding--;
                 }
-                while (padding--) {
-                    ab_append(ab, " ", 1);
-                }
+                ab_fill(ab, ' ', padding);
                 ab_append(ab, welcome, welcome_len);
             }
             else {
@@ -636,79 +5752,283 @@ void draw_rows(struct AppendBuf *ab)
             }
         }
         else {
-            int len = E.rows[file_row].rsize - E.col_offset;
-            if (len < 0) len = 0;
-            if (len > E.screen_cols) len = E.screen_cols;
-            ab_append(ab, &E.rows[file_row].render[E.col_offset], len);
+            if (row->flags & ROW_MAPPED) map_touch(row->chars);
+            char *render = row_render(row);
+            int from = E.buf->wrap_cols ? sub * E.buf->wrap_cols : E.win->col_offset;
+            int to = from + E.screen_cols;
+            int from_col, to_col;
+            int from_rb = rx_to_rb(row, from, &from_col);
+            if (from_col < from) {
+                /* a wide character cut by the left edge, its right half shows as a space */
+                from_rb = rx_to_rb(row, from + 1, &from_col);
+            }
+            int to_rb = rx_to_rb(row, to, &to_col);
+            if (to_rb < from_rb) to_rb = from_rb;
+            int base = 0;
+            if (render == NULL) {
+                /* only the part of a long row on screen is rendered */
+                render = row_render_span(row, from_rb, to_rb, &E.screen.span);
+                base = from_rb;
+            }
+
+            int color = 39; /* every line starts and ends in the default color */
+            if (from_col > from && from < row->rsize) {
+                ab_fill(ab, ' ', from_col - from);
+            }
+            if (E.search.active && E.search.qlen && E.search.buf == E.buf) {
+                draw_matches(ab, row, render, base, from_rb, to_rb, &color);
+            }
+            else {
+                draw_span(ab, render, row_hl(row), from_rb - base, to_rb - base, &color);
+            }
+            if (color != 39) {
+                ab_append(ab, "\x1b[39m", 5);
+            }
+            if (to_col < to && to_col < row->rsize) {
+                /* the same for one cut by the right edge */
+                ab_fill(ab, ' ', to - to_col);
+            }
+            /* a wrapped row goes on until all of its lines are drawn */
+            if (!E.buf->wrap_cols || ++sub >= row_lines(row)) {
+                row = row_iter_next(&it);
+                sub = 0;
+            }
         }
 
-        ab_append(ab, "\x1b[K", 3);
-        ab_append(ab, "\r\n", 2);
+        screen_end_line(ab);
     }
 }
 
-/* draw a status bar at the bottom of the screen */
+/* draw a status bar under the current window */
 void draw_status_bar(struct AppendBuf *ab)
 {
     ab_append(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.num_rows,
-        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cursor_y + 1, E.num_rows);
+    char status[80], rstatus[80], load[32] = "";
+    if (rows_loading()) {
+        load_progress(load, sizeof(load));
+    }
+    else if (E.buf->follow) {
+        snprintf(load, sizeof(load), "(following) ");
+    }
+    int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s%s",
+        E.buf->filename ? E.buf->filename : "[No Name]", E.buf->num_rows,
+        rows_loading() ? "+" : "", load,
+        E.buf->save && !E.buf->save->swap ? "(saving)" : E.buf->dirty ? "(modified)" : "");
+    int rlen;
+    if (E.search.active && E.search.qlen && E.search.buf == E.buf) {
+        rlen = search_progress(rstatus, sizeof(rstatus));
+    }
+    else {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | @%lld",
+            E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.win->cursor_y + 1, E.buf->num_rows,
+            row_byte(E.win->cursor_y) + E.win->cursor_x);
+    }
     if (len > E.screen_cols) {
         len = E.screen_cols;
     }
     ab_append(ab, status, len);
-    while (len < E.screen_cols) {
-        if (E.screen_cols - len == rlen) {
-            ab_append(ab, rstatus, rlen);
-            break;
-        }
-        else {
-            ab_append(ab, " ", 1);
-            len++;
-        }
+    int padding = E.screen_cols - len;
+    if (padding >= rlen) {
+        ab_fill(ab, ' ', padding - rlen);
+        ab_append(ab, rstatus, rlen);
+    }
+    else {
+        ab_fill(ab, ' ', padding);
     }
     ab_append(ab, "\x1b[m", 3);
-    ab_append(ab, "\r\n", 2);
+    screen_end_line(ab);
+}
+
+/* draw every window with its status bar, from the top of the screen down */
+void draw_windows(struct AppendBuf *ab)
+{
+    struct Window *cur = E.win;
+    int i;
+    for (i = 0; i < E.num_windows; i++) {
+        E.win = E.windows[i];
+        E.buf = E.win->buf;
+        /* the current window is scrolled already */
+        if (E.win != cur) {
+            window_clamp();
+            editor_scroll();
+        }
+        draw_rows(ab);
+        draw_status_bar(ab);
+    }
+    E.win = cur;
+    E.buf = cur->buf;
 }
 
 /* draw a message bar at the bottom of the screen */
 void draw_message_bar(struct AppendBuf *ab)
 {
-    ab_append(ab, "\x1b[K", 3);
     int len = strlen(E.status_msg);
     if (len > E.screen_cols) {
         len = E.screen_cols;
     }
-    if (len && time(NULL) - E.status_msg_time < 5) {
+    E.status_msg_shown = len && time(NULL) - E.status_msg_time < 5;
+    if (E.status_msg_shown) {
         ab_append(ab, E.status_msg, len);
     }
+    else if (E.perf.shown) {
+        len = strlen(E.perf.summary);
+        ab_append(ab, E.perf.summary, len < E.screen_cols ? len : E.screen_cols);
+    }
+    screen_end_line(ab);
+}
+
+/* start drawing a new frame into E.screen.cur */
+void screen_begin(void)
+{
+    struct Screen *sc = &E.screen;
+    int rows = E.screen_rows + 2;
+    if (rows != sc->rows) {
+        sc->cur_line = realloc(sc->cur_line, sizeof(struct ScreenLine) * rows);
+        sc->prev_line = realloc(sc->prev_line, sizeof(struct ScreenLine) * rows);
+        sc->rows = rows;
+        sc->valid = 0;
+    }
+    sc->lines = 0;
+    ab_reset(&sc->cur);
+}
+
+/* finish the current screen line, everything appended since the last one */
+void screen_end_line(struct AppendBuf *ab)
+{
+    struct Screen *sc = &E.screen;
+    if (sc->lines == sc->rows) return;
+
+    int off = 0;
+    if (sc->lines > 0) {
+        off = sc->cur_line[sc->lines - 1].off + sc->cur_line[sc->lines - 1].len;
+    }
+    sc->cur_line[sc->lines].off = off;
+    sc->cur_line[sc->lines].len = ab->len - off;
+    sc->lines++;
+}
+
+/* scroll the text area of the terminal and of the previous frame by d lines */
+void screen_scroll(struct AppendBuf *ab, int d)
+{
+    struct Screen *sc = &E.screen;
+    int n = E.screen_rows;
+    int i;
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", n, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    ab_append(ab, buf, strlen(buf));
+
+    if (d > 0) {
+        for (i = 0; i < n; i++) {
+            if (i + d < n) {
+                sc->prev_line[i] = sc->prev_line[i + d];
+            }
+            else {
+                sc->prev_line[i].len = 0;
+            }
+        }
+    }
+    else {
+        for (i = n - 1; i >= 0; i--) {
+            if (i + d >= 0) {
+                sc->prev_line[i] = sc->prev_line[i + d];
+            }
+            else {
+                sc->prev_line[i].len = 0;
+            }
+        }
+    }
+}
+
+/* emit the lines of the drawn frame that differ from the previous one */
+void screen_flush(struct AppendBuf *ab)
+{
+    struct Screen *sc = &E.screen;
+    int d = E.win->line_offset - sc->prev_line_offset;
+    int i;
+    char buf[32];
+
+    /* the terminal can only scroll the text for a single window */
+    if (sc->valid && E.num_windows == 1 && d != 0 && d < E.screen_rows && -d < E.screen_rows) {
+        screen_scroll(ab, d);
+    }
+
+    for (i = 0; i < sc->lines; i++) {
+        char *new = sc->cur.buf + sc->cur_line[i].off;
+        int len = sc->cur_line[i].len;
+        int p = 0;
+
+        if (sc->valid) {
+            char *old = sc->prev.buf + sc->prev_line[i].off;
+            int old_len = sc->prev_line[i].len;
+            if (len == old_len && memcmp(new, old, len) == 0) {
+                continue;
+            }
+            /*
+            * skip the unchanged start, as long as it is plain text we know the
+            * width of and no combining mark after it changes the last cell
+            */
+            while (p < len && p < old_len && new[p] == old[p] && new[p] >= ' ' && new[p] < 127
+                    && !(p + 1 < len && (new[p + 1] & 0x80)) && !(p + 1 < old_len && (old[p + 1] & 0x80))) {
+                p++;
+            }
+        }
+
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[K", i + 1, p + 1);
+        ab_append(ab, buf, strlen(buf));
+        ab_append(ab, new + p, len - p);
+    }
+
+    /* the drawn frame is now the one on the terminal, reuse the old one */
+    struct AppendBuf frame = sc->prev;
+    struct ScreenLine *lines = sc->prev_line;
+    sc->prev = sc->cur;
+    sc->prev_line = sc->cur_line;
+    sc->cur = frame;
+    sc->cur_line = lines;
+
+    sc->prev_line_offset = E.win->line_offset;
+    sc->valid = 1;
 }
 
 /* refresh the screen */
 void refresh_screen(void)
 {
+    /* whatever ran since the key was read acted on it */
+    if (E.perf.open) {
+        perf_mark(PERF_EDIT);
+    }
+    else {
+        perf_restart();
+    }
     editor_scroll();
+    perf_mark(PERF_SCROLL);
 
-    struct AppendBuf ab = APPEND_BUF_INIT;
+    screen_begin();
+    draw_windows(&E.screen.cur);
+    draw_message_bar(&E.screen.cur);
+    perf_mark(PERF_DRAW);
 
-    ab_append(&ab, "\x1b[?25l", 6);
-    ab_append(&ab, "\x1b[H", 3);
+    struct AppendBuf *ab = &E.screen.out;
+    ab_reset(ab);
 
-    draw_rows(&ab);
-    draw_status_bar(&ab);
-    draw_message_bar(&ab);
+    ab_append(ab, "\x1b[?25l", 6);
+    screen_flush(ab);
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursor_y - E.row_offset) + 1, (E.rx - E.col_offset) + 1);
-    ab_append(&ab, buf, strlen(buf));
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.win->top + (E.win->cursor_line - E.win->line_offset) + 1,
+            (E.win->rx - E.win->col_offset) + 1);
+    ab_append(ab, buf, strlen(buf));
 
-    ab_append(&ab, "\x1b[?25h", 6);
+    ab_append(ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.buf, ab.len);
-    ab_free(&ab);
+    write(STDOUT_FILENO, ab->buf, ab->len);
+    E.screen.frame_bytes = ab->len;
+    E.screen.total_bytes += ab->len;
+    E.screen.frames++;
+    E.screen.frame_time = perf_now();
+    perf_mark(PERF_WRITE);
+    perf_end_frame(ab->len);
 }
 
 /* set a status message */
@@ -721,6 +6041,33 @@ void set_status_message(const char *fmt, ...)
     E.status_msg_time = time(NULL);
 }
 
+/* add bytes to a prompt buffer */
+void prompt_append(char **buf, size_t *bufsize, size_t *buflen, const char *s, int len)
+{
+    size_t size = *bufsize;
+    while (*buflen + len >= size) {
+        size *= 2;
+    }
+    if (size != *bufsize) {
+        /* out of memory drops the text, as ab_append does, and keeps the buffer */
+        char *new = realloc(*buf, size);
+        if (new == NULL) return;
+        *buf = new;
+        *bufsize = size;
+    }
+    memcpy(*buf + *buflen, s, len);
+    *buflen += len;
+    (*buf)[*buflen] = '\0';
+}
+
+/* add a typed character to a prompt buffer, ignoring control keys */
+void prompt_put(char **buf, size_t *bufsize, size_t *buflen, int c)
+{
+    if ((c < 128 && iscntrl(c)) || c >= ARROW_LEFT) return;
+    char ch[4];
+    prompt_append(buf, bufsize, buflen, ch, utf8_encode(c, ch));
+}
+
 /* prompt the user to enter a filename when saving a new file */
 char *editor_prompt(char *prompt, void (*callback)(char *, int))
 {
@@ -736,9 +6083,9 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 
         int c = read_keypress();
         if (c ==DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) {
-                buf[--buflen] = '\0';
-            }
+            /* drop the continuation bytes of the last character too */
+            while (buflen != 0 && (buf[--buflen] & 0xc0) == 0x80);
+            buf[buflen] = '\0';
         }
         else if (c == '\x1b') {
             set_status_message("");
@@ -753,60 +6100,436 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
                 return buf;
             }
         }
-        else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+        else if (c == PASTE_KEY) {
+            int i;
+            for (i = 0; i < E.paste.len; i++) {
+                unsigned char b = E.paste.buf[i];
+                if (b >= 128 || !iscntrl(b)) prompt_append(&buf, &bufsize, &buflen, &E.paste.buf[i], 1);
+            }
+        }
+        else {
+            prompt_put(&buf, &bufsize, &buflen, c);
+        }
+
+        if (callback) callback(buf, c);
+    }
+}
+
+/* move the cursor using the arrow keys */
+void move_cursor(int key)
+{
+    ERow *row = (E.win->cursor_y >= E.buf->num_rows) ? NULL : row_at(E.win->cursor_y);
+    int rx = row ? cx_to_rx(row, E.win->cursor_x) : 0;
+    undo_seal();
+
+    switch (key) {
+        case ARROW_UP:
+            if (E.buf->wrap_cols && row && row_sub_line(row, rx) > 0) {
+                /* up a visual line inside a wrapped row */
+                E.win->cursor_x = rx_to_cx(row, rx - E.buf->wrap_cols);
+            }
+            else if (E.win->cursor_y != 0) {
+                E.win->cursor_y--;
+                ERow *up = row_at(E.win->cursor_y);
+                if (E.buf->wrap_cols) rx += (row_lines(up) - 1) * E.buf->wrap_cols;
+                /* stay in the same screen column across tabs */
+                E.win->cursor_x = rx_to_cx(up, rx);
+            }
+            break;
+        case ARROW_DOWN:
+            if (E.buf->wrap_cols && row && row_sub_line(row, rx) < row_lines(row) - 1) {
+                E.win->cursor_x = rx_to_cx(row, rx + E.buf->wrap_cols);
+            }
+            else if (E.win->cursor_y < E.buf->num_rows) {
+                E.win->cursor_y++;
+                if (E.buf->wrap_cols && row) rx -= row_sub_line(row, rx) * E.buf->wrap_cols;
+                if (E.win->cursor_y < E.buf->num_rows) {
+                    E.win->cursor_x = rx_to_cx(row_at(E.win->cursor_y), rx);
+                }
+            }
+            break;
+        case ARROW_LEFT:
+            if (E.win->cursor_x != 0) {
+                E.win->cursor_x = row_prev_char(row, E.win->cursor_x);
+            }
+            else if (E.win->cursor_y > 0) {
+                E.win->cursor_y--;
+                E.win->cursor_x = row_at(E.win->cursor_y)->size;
+            }
+            break;
+        case ARROW_RIGHT:
+            if (row && E.win->cursor_x < row->size) {
+                E.win->cursor_x = row_next_char(row, E.win->cursor_x);
+            }
+            else if (row && E.win->cursor_x == row->size) {
+                E.win->cursor_y++;
+                E.win->cursor_x = 0;
+            }
+            break;
+    }
+
+    row = (E.win->cursor_y >= E.buf->num_rows) ? NULL : row_at(E.win->cursor_y);
+    int row_len = row ? row->size : 0;
+    if (E.win->cursor_x > row_len) {
+        E.win->cursor_x = row_len;
+    }
+}
+
+/*
+* move a screen of visual lines up (dir -1) or down (dir 1) while wrapping,
+* leaving the cursor at the top or bottom of the new screen
+*/
+void editor_page_wrapped(int dir)
+{
+    int line = dir < 0 ? E.win->line_offset - E.win->height : E.win->line_offset + 2 * E.win->height - 1;
+    int col = E.win->rx - E.win->col_offset;
+    int sub;
+    undo_seal();
+    rows_ensure(E.win->row_offset + 2 * E.win->height);
+    if (line < 0) line = 0;
+    E.win->cursor_y = line_row(line, &sub);
+    E.win->cursor_x = 0;
+    if (E.win->cursor_y < E.buf->num_rows) {
+        E.win->cursor_x = rx_to_cx(row_at(E.win->cursor_y), sub * E.buf->wrap_cols + col);
+    }
+}
+
+/*
+* move a screen of rows up (dir -1) or down (dir 1) without wrapping, from
+* the top or bottom row of the screen, staying in the same screen column
+*/
+void editor_page(int dir)
+{
+    int rx = E.win->rx;
+    int y;
+    undo_seal();
+    if (dir < 0) {
+        y = E.win->row_offset - E.win->height;
+        if (y < 0) y = 0;
+    }
+    else {
+        y = E.win->row_offset + 2 * E.win->height - 1;
+        rows_ensure(y);
+        if (y > E.buf->num_rows) y = E.buf->num_rows;
+    }
+    E.win->cursor_y = y;
+    E.win->cursor_x = 0;
+    if (y < E.buf->num_rows) {
+        E.win->cursor_x = rx_to_cx(row_at(y), rx);
+    }
+}
+
+/*
+* put the cursor on a line number, or on a byte offset of the text when
+* it ends with b, loading only as much of the file as that needs
+*/
+void editor_goto(void)
+{
+    char *query = editor_prompt("Go to line, or byte offset with b: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+    char *end;
+    errno = 0;
+    long long n = strtoll(query, &end, 10);
+    int bytes = *end == 'b' || *end == 'B';
+    if (bytes) end++;
+    if (end == query || *end != '\0' || errno || n < (bytes ? 0 : 1)) {
+        set_status_message("Not a line or byte offset: %.40s", query);
+        free(query);
+        return;
+    }
+    free(query);
+    undo_seal();
+
+    if (bytes) {
+        int col;
+        rows_ensure_to(0, n);
+        E.win->cursor_y = byte_row(n, &col);
+        E.win->cursor_x = 0;
+        if (E.win->cursor_y < E.buf->num_rows) {
+            ERow *row = row_at(E.win->cursor_y);
+            /* land on the start of a character, not inside one */
+            while (col > 0 && col < row->size && (row->chars[col] & 0xc0) == 0x80) {
+                col--;
+            }
+            E.win->cursor_x = col;
+        }
+    }
+    else {
+        int y = n > INT_MAX ? INT_MAX : n - 1;
+        rows_ensure(y);
+        E.win->cursor_y = y < E.buf->num_rows ? y : E.buf->num_rows;
+        E.win->cursor_x = 0;
+    }
+    /* show the target in the middle of the window */
+    E.win->row_offset = E.win->cursor_y - E.win->height / 2;
+    if (E.win->row_offset < 0) E.win->row_offset = 0;
+    E.win->wrap_skip = 0;
+}
+
+/*
+* start an empty buffer and add it to the open ones
+* returns: the buffer
+*/
+struct Buffer *buffer_new(void)
+{
+    struct Buffer *b = calloc(1, sizeof(struct Buffer));
+    if (b == NULL) display_error("calloc");
+    b->rows.root = leaf_new();
+    b->load_fd = -1;
+    b->follow_fd = -1;
+    b->follow_wd = -1;
+    b->follow_dir_wd = -1;
+
+    E.buffers = realloc(E.buffers, sizeof(struct Buffer *) * (E.num_buffers + 1));
+    if (E.buffers == NULL) display_error("realloc");
+    E.buffers[E.num_buffers++] = b;
+    return b;
+}
+
+/* free the nodes and give back the leaves of a tree, not the text of its rows */
+void tree_free(void *n, int height)
+{
+    if (height > 0) {
+        RowNode *node = n;
+        int i;
+        for (i = 0; i < node->count; i++) {
+            tree_free(node->child[i], height - 1);
+        }
+        free(n);
+    }
+    else {
+        leaf_free(n);
+    }
+}
+
+/* close a buffer no window shows anymore, and free everything it holds */
+void buffer_free(struct Buffer *b)
+{
+    struct Buffer *cur = E.buf;
+    E.buf = b;
+    save_finish();
+    swap_remove();
+
+    RowIter it;
+    ERow *row;
+    for (row = row_iter_start(&it, 0); row; row = row_iter_next(&it)) {
+        free_row(row);
+    }
+    tree_free(b->rows.root, b->rows.height);
+    if (b->map) munmap(b->map, b->map_len);
+    if (b->load_fd != -1) close(b->load_fd);
+    if (b->follow_fd != -1) close(b->follow_fd);
+    free(b->load_buf);
+    ab_free(&b->index_log);
+    free(b->orphans);
+    free(b->undo.log);
+    free(b->filename);
+    E.buf = cur;
+
+    int i;
+    for (i = 0; E.buffers[i] != b; i++);
+    memmove(&E.buffers[i], &E.buffers[i + 1], sizeof(struct Buffer *) * (E.num_buffers - i - 1));
+    E.num_buffers--;
+    free(b);
+}
+
+/*
+* add a window showing a buffer at position at from the top
+* returns: the window
+*/
+struct Window *window_add(struct Buffer *b, int at)
+{
+    struct Window *w = calloc(1, sizeof(struct Window));
+    if (w == NULL) display_error("calloc");
+    w->buf = b;
+    b->refs++;
+
+    E.windows = realloc(E.windows, sizeof(struct Window *) * (E.num_windows + 1));
+    if (E.windows == NULL) display_error("realloc");
+    memmove(&E.windows[at + 1], &E.windows[at], sizeof(struct Window *) * (E.num_windows - at));
+    E.windows[at] = w;
+    E.num_windows++;
+    return w;
+}
+
+/* index of the current window in E.windows */
+int window_index(void)
+{
+    int i;
+    for (i = 0; E.windows[i] != E.win; i++);
+    return i;
+}
+
+/* share the lines above the message bar out between the windows, a status bar under each */
+void editor_layout(void)
+{
+    int lines = E.screen_rows + 1;
+    int top = 0;
+    int i;
+    for (i = 0; i < E.num_windows; i++) {
+        int share = lines / E.num_windows + (i < lines % E.num_windows);
+        E.windows[i]->top = top;
+        E.windows[i]->height = share - 1;
+        top += share;
+    }
+    E.screen.valid = 0;
+}
+
+/* keep the cursor of the current window in its buffer, edits from other windows may have moved the end */
+void window_clamp(void)
+{
+    struct Window *w = E.win;
+    if (w->cursor_y > E.buf->num_rows) {
+        w->cursor_y = E.buf->num_rows;
+    }
+    int size = w->cursor_y < E.buf->num_rows ? row_at(w->cursor_y)->size : 0;
+    if (w->cursor_x > size) {
+        w->cursor_x = size;
+    }
+}
+
+/* make a window the current one */
+void window_enter(struct Window *w)
+{
+    undo_seal();
+    E.win = w;
+    E.buf = w->buf;
+    window_clamp();
+}
+
+/* show a buffer in the current window, where its cursor was when it was last shown */
+void window_show(struct Buffer *b)
+{
+    struct Window *w = E.win;
+    if (b == w->buf) return;
+
+    undo_seal();
+    render_drop_unkept(w->render_lo, w->render_hi, 0);
+    w->buf->last_x = w->cursor_x;
+    w->buf->last_y = w->cursor_y;
+    w->buf->refs--;
+    b->refs++;
+
+    int top = w->top;
+    int height = w->height;
+    memset(w, 0, sizeof(struct Window));
+    w->buf = b;
+    w->top = top;
+    w->height = height;
+    w->cursor_x = b->last_x;
+    w->cursor_y = b->last_y;
+    E.buf = b;
+    window_clamp();
+}
+
+/* open a file in the current window, sharing the buffer of one that is open already */
+void editor_open_buffer(char *filename)
+{
+    struct stat st;
+    int i;
+    if (stat(filename, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            set_status_message("Can't open %s: %s", filename, strerror(EISDIR));
+            return;
+        }
+        for (i = 0; i < E.num_buffers; i++) {
+            struct Buffer *b = E.buffers[i];
+            if (b->ino && b->dev == st.st_dev && b->ino == st.st_ino) {
+                window_show(b);
+                return;
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
         }
+    }
 
-        if (callback) callback(buf, c);
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        set_status_message("Can't open %s: %s", filename, strerror(errno));
+        return;
     }
+    close(fd);
+    window_show(buffer_new());
+    editor_open(filename);
 }
 
-/* move the cursor using the arrow keys */
-void move_cursor(int key)
+/* show the buffer after the current one in the current window */
+void buffer_next(void)
 {
-    ERow *row = (E.cursor_y >= E.num_rows) ? NULL : &E.rows[E.cursor_y];
+    if (E.num_buffers == 1) {
+        set_status_message("No other files are open");
+        return;
+    }
+    int i;
+    for (i = 0; E.buffers[i] != E.buf; i++);
+    window_show(E.buffers[(i + 1) % E.num_buffers]);
+}
 
-    switch (key) {
-        case ARROW_UP:
-            if (E.cursor_y != 0) {
-                E.cursor_y--;
-            }
-            break;
-        case ARROW_DOWN:
-            if (E.cursor_y < E.num_rows) {
-                E.cursor_y++;
-            }
-            break;
-        case ARROW_LEFT:
-            if (E.cursor_x != 0) {
-                E.cursor_x--;
-            }
-            else if (E.cursor_y > 0) {
-                E.cursor_y--;
-                E.cursor_x = E.rows[E.cursor_y].size;
-            }
-            break;
-        case ARROW_RIGHT:
-            if (row && E.cursor_x < row->size) {
-                E.cursor_x++;
-            }
-            else if (row && E.cursor_x == row->size) {
-                E.cursor_y++;
-                E.cursor_x = 0;
-            }
-            break;
+/* split the current window in two, both showing its buffer */
+void window_split(void)
+{
+    if (E.win->height < 3) {
+        set_status_message("No room to split the window");
+        return;
     }
+    struct Window *w = window_add(E.buf, window_index() + 1);
+    struct Window *cur = E.win;
+    *w = *cur;
+    editor_layout();
+}
 
-    row = (E.cursor_y >= E.num_rows) ? NULL : &E.rows[E.cursor_y];
-    int row_len = row ? row->size : 0;
-    if (E.cursor_x > row_len) {
-        E.cursor_x = row_len;
+/* move the cursor to the window below, or back to the top one */
+void window_next(void)
+{
+    window_enter(E.windows[(window_index() + 1) % E.num_windows]);
+}
+
+/*
+* close the current window, or show another buffer in it if it is the only
+* one, the buffer is closed with the last window showing it
+*/
+void window_close(void)
+{
+    struct Buffer *b = E.buf;
+    if (b->refs == 1) {
+        save_finish();
+        if (b->dirty) {
+            set_status_message("File has unsaved changes, use ^S to save it first");
+            return;
+        }
+    }
+
+    if (E.num_windows == 1) {
+        if (E.num_buffers == 1) {
+            set_status_message("No other files are open");
+            return;
+        }
+        buffer_next();
+    }
+    else {
+        struct Window *w = E.win;
+        int i = window_index();
+        render_drop_unkept(w->render_lo, w->render_hi, 0);
+        memmove(&E.windows[i], &E.windows[i + 1], sizeof(struct Window *) * (E.num_windows - i - 1));
+        E.num_windows--;
+        b->refs--;
+        free(w);
+        window_enter(E.windows[i > 0 ? i - 1 : 0]);
+        editor_layout();
+    }
+    if (b->refs == 0) buffer_free(b);
+}
+
+/*
+* count the open files with unsaved changes
+* returns: number of modified buffers
+*/
+int editor_dirty_buffers(void)
+{
+    int n = 0;
+    int i;
+    for (i = 0; i < E.num_buffers; i++) {
+        if (E.buffers[i]->dirty) n++;
     }
+    return n;
 }
 
 /* process user keypresses */
@@ -815,6 +6538,8 @@ void process_keypress(void)
     static int quit_times = QUIT_TIMES;
 
     int c = read_keypress();
+    struct Window *w = E.win;
+    int y = w->cursor_y;
 
     switch (c) {
         case '\r':
@@ -822,16 +6547,21 @@ void process_keypress(void)
             break;
         
         /* quit when ^Q is pressed */
-        case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
+        case CTRL_KEY('q'): {
+            int dirty = editor_dirty_buffers();
+            if (dirty == 1 && quit_times > 0) {
                 set_status_message("WARNING: File has unsaved changes. Use ^S to save or Press ^Q %d more times to quit.", quit_times);
                 quit_times--;
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
+            if (dirty > 1 && quit_times > 0) {
+                set_status_message("WARNING: %d files have unsaved changes. Press ^Q %d more times to quit.", dirty, quit_times);
+                quit_times--;
+                return;
+            }
+            editor_exit();
             break;
+        }
         
         /* save when ^S is pressed */
         case CTRL_KEY('s'):
@@ -839,17 +6569,65 @@ void process_keypress(void)
             break;
         
         case HOME_KEY:
-            E.cursor_x = 0;
+            E.win->cursor_x = 0;
             break;
         case END_KEY:
-            if (E.cursor_y < E.num_rows) {
-                E.cursor_x = E.rows[E.cursor_y].size;
+            if (E.win->cursor_y < E.buf->num_rows) {
+                E.win->cursor_x = row_at(E.win->cursor_y)->size;
             }
             break;
 
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+
+        case CTRL_KEY('w'):
+            editor_set_wrap(E.buf->wrap_cols ? 0 : E.screen_cols);
+            set_status_message(E.buf->wrap_cols ? "Wrapping long lines" : "Not wrapping long lines");
+            break;
+
         case CTRL_KEY('f'):
             editor_find();
             break;
+
+        case CTRL_KEY('r'):
+            editor_replace();
+            break;
+
+        case CTRL_KEY('j'):
+            editor_goto();
+            break;
+
+        /* open a file, or show the same buffer if it is open already */
+        case CTRL_KEY('o'): {
+            char *name = editor_prompt("Open: %s", NULL);
+            if (name) {
+                editor_open_buffer(name);
+                free(name);
+            }
+            break;
+        }
+        case CTRL_KEY('n'):
+            buffer_next();
+            break;
+
+        /* split the window, move between the windows, close one */
+        case CTRL_KEY('x'):
+            window_split();
+            break;
+        case CTRL_KEY('p'):
+            window_next();
+            break;
+        case CTRL_KEY('k'):
+            window_close();
+            break;
+
+        case PASTE_KEY:
+            insert_text(E.paste.buf, E.paste.len);
+            break;
         
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -860,20 +6638,11 @@ void process_keypress(void)
 
         case PAGE_UP:
         case PAGE_DOWN:
-            {
-                if (c == PAGE_UP) {
-                    E.cursor_y = E.row_offset;
-                }
-                else if (c == PAGE_DOWN) {
-                    E.cursor_y = E.row_offset + E.screen_rows - 1;
-                    if (E.cursor_y > E.num_rows) {
-                        E.cursor_y = E.num_rows;                        
-                    }
-                }
-                int times = E.screen_rows;
-                while (times--) {
-                    move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
+            if (E.buf->wrap_cols) {
+                editor_page_wrapped(c == PAGE_UP ? -1 : 1);
+            }
+            else {
+                editor_page(c == PAGE_UP ? -1 : 1);
             }
             break;
         
@@ -884,7 +6653,28 @@ void process_keypress(void)
             move_cursor(c);
             break;
         
+        /* repaint everything, e.g. after the terminal got garbled */
         case CTRL_KEY('l'):
+            E.screen.valid = 0;
+            set_status_message("Last frame %ld bytes, %ld bytes in %ld frames",
+                E.screen.frame_bytes, E.screen.total_bytes, E.screen.frames);
+            break;
+
+        /* frame timings on the message bar */
+        case CTRL_KEY('t'):
+            E.perf.shown = !E.perf.shown;
+            E.perf.summed = 0;
+            snprintf(E.perf.summary, sizeof(E.perf.summary), "p50/p99 us: measuring");
+            E.status_msg[0] = '\0';
+            break;
+
+        case CTRL_KEY('g'): {
+            char report[80];
+            arena_report(report, sizeof(report));
+            set_status_message("%s", report);
+            break;
+        }
+
         case '\x1b':
             break;
 
@@ -893,44 +6683,619 @@ void process_keypress(void)
             break;
     }
 
+    /* moving off the last row stops following new rows, moving back resumes it */
+    if (E.buf->follow && E.win == w && E.win->cursor_y != y) {
+        E.buf->follow_tail = E.win->cursor_y >= E.buf->num_rows - 1;
+    }
     quit_times = QUIT_TIMES;
 }
 
+/*
+* ms until the next frame should be drawn: FRAME_MIN_MS after the last one,
+* and later while the terminal has not sent out what it was given
+*/
+int frame_due_in(void)
+{
+    int since = (perf_now() - E.screen.frame_time) / 1000000;
+    if (since >= FRAME_MAX_DEFER_MS) return 0;
+    int queued;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) == 0 && queued > 0) {
+        return 1;
+    }
+    return since < FRAME_MIN_MS ? FRAME_MIN_MS - since : 0;
+}
+
+/*
+* apply the keys that are in or arrive until the next frame is due, so
+* fast typing and key repeat get one redraw per frame instead of one per
+* key; keys still coming when it is due are held for the frame after
+*/
+void editor_drain_keys(void)
+{
+    while (1) {
+        while (frame_due_in() > 0 && input_key_ready()) {
+            /* paging goes from where the last key left the screen */
+            editor_scroll();
+            process_keypress();
+        }
+        int wait = frame_due_in();
+        if (wait == 0) return;
+        struct pollfd fds[2] = {
+            {E.input.fd, POLLIN, 0},
+            {E.wake_pipe[0], POLLIN, 0}
+        };
+        int n = poll(fds, 2, wait);
+        perf_skip();
+        if (n > 0 && (fds[1].revents & POLLIN)) editor_wake();
+        if (n == 0 && frame_due_in() == 0) return;
+    }
+}
+
 /* initialize editor */
 void editor_init(void)
 {
-    E.cursor_x = 0;
-    E.cursor_y = 0;
-    E.rx = 0;
-    E.row_offset = 0;
-    E.col_offset = 0;
-    E.num_rows = 0;
-    E.rows = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.buffers = NULL;
+    E.num_buffers = 0;
+    E.windows = NULL;
+    E.num_windows = 0;
+    E.buf = buffer_new();
+    E.win = window_add(E.buf, 0);
     E.status_msg[0] = '\0';
     E.status_msg_time = 0;
+    E.status_msg_shown = 0;
+    E.autosave_time = time(NULL);
+    E.input.start = 0;
+    E.input.end = 0;
+    E.input.fd = STDIN_FILENO;
+    E.input.key = -1;
+    memset(&E.screen, 0, sizeof(E.screen));
+    memset(&E.search, 0, sizeof(E.search));
+    memset(&E.perf, 0, sizeof(E.perf));
+    E.search.match_row = -1;
+}
 
+/* size the editor to the terminal, leaving room for the status lines */
+void editor_update_size(void)
+{
     if (get_window_size(&E.screen_rows, &E.screen_cols) == -1) {
         display_error("get_window_size");
     }
     E.screen_rows -= 2;
+    editor_layout();
+}
+
+/* adapt to a new terminal size */
+void editor_resize(void)
+{
+    editor_update_size();
+    struct Buffer *cur = E.buf;
+    int i;
+    for (i = 0; i < E.num_buffers; i++) {
+        E.buf = E.buffers[i];
+        if (E.buf->wrap_cols && E.buf->wrap_cols != E.screen_cols) {
+            /* only the sums change, every row already knows its width */
+            editor_set_wrap(E.screen_cols);
+        }
+    }
+    E.buf = cur;
+    E.screen.valid = 0;
+    refresh_screen();
+}
+
+#ifdef TXTEDIT_BENCH
+/* monotonic time in seconds */
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* count lines the way editor_open did before the newline scanners */
+size_t bench_count_getline(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("fopen");
+        exit(1);
+    }
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    size_t lines = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
+            linelen--;
+        }
+        lines++;
+    }
+    free(line);
+    fclose(fp);
+    return lines;
 }
 
+/* count lines of a buffer with one of the newline scanners */
+size_t bench_count_scanner(NewlineScanner scan, const char *buf, size_t len)
+{
+    size_t ends[INDEX_BATCH];
+    size_t pos = 0;
+    size_t lines = 0;
+    size_t n;
+    do {
+        n = scan(buf + pos, len - pos, ends, INDEX_BATCH);
+        lines += n;
+        if (n) pos += ends[n - 1] + 1;
+    } while (n == INDEX_BATCH);
+    return lines;
+}
+
+/* throughput of the getline path against every newline scanner */
+void bench_scan(const char *path)
+{
+    struct {
+        const char *name;
+        NewlineScanner scan;
+    } scanners[] = {
+        {"scalar", find_newlines_scalar},
+#if defined(__SSE2__)
+        {"sse2", find_newlines_sse2},
+#endif
+#ifdef HAVE_AVX2_SCANNER
+        {"avx2", __builtin_cpu_supports("avx2") ? find_newlines_avx2 : NULL},
+#endif
+#if defined(__ARM_NEON)
+        {"neon", find_newlines_neon},
+#endif
+    };
+    const int rounds = 5;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        perror(path);
+        exit(1);
+    }
+    char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    double gb = st.st_size / 1e9;
+
+    size_t lines = 0;
+    double t = bench_now();
+    int r;
+    for (r = 0; r < rounds; r++) {
+        lines = bench_count_getline(path);
+    }
+    t = (bench_now() - t) / rounds;
+    printf("%-8s %10zu lines %8.3f s %8.2f GB/s\n", "getline", lines, t, gb / t);
+
+    size_t i;
+    for (i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+        if (scanners[i].scan == NULL) continue;
+        t = bench_now();
+        for (r = 0; r < rounds; r++) {
+            lines = bench_count_scanner(scanners[i].scan, buf, st.st_size);
+        }
+        t = (bench_now() - t) / rounds;
+        printf("%-8s %10zu lines %8.3f s %8.2f GB/s\n", scanners[i].name, lines, t, gb / t);
+    }
+    munmap(buf, st.st_size);
+}
+
+/* time refresh_screen in one way of changing the screen between frames */
+void bench_frames(const char *name, int mode)
+{
+    const int frames = 2000;
+    long allocs = 0;
+    long grows = E.screen.grows;
+    long bytes = E.screen.total_bytes;
+    double t = 0;
+    int i;
+
+    E.win->cursor_x = 0;
+    E.win->cursor_y = 0;
+    E.win->row_offset = 0;
+    refresh_screen();
+    for (i = 0; i < frames; i++) {
+        if (mode == 0) {
+            E.screen.valid = 0;
+        }
+        else if (mode == 1 && E.win->cursor_y < E.buf->num_rows - 1) {
+            E.win->cursor_y++;
+        }
+        else if (mode == 2) {
+            insert_char('x');
+        }
+
+        long a = alloc_count;
+        double start = bench_now();
+        refresh_screen();
+        t += bench_now() - start;
+        allocs += alloc_count - a;
+    }
+    fprintf(stderr, "%-8s %10.0f ns/frame %8.2f allocs/frame %8.0f bytes/frame %6ld buffer grows\n",
+        name, t / frames * 1e9, (double)allocs / frames,
+        (double)(E.screen.total_bytes - bytes) / frames, E.screen.grows - grows);
+}
+
+/* send frames to /dev/null while they are measured, results go to stderr */
+int bench_mute(void)
+{
+    int devnull = open("/dev/null", O_WRONLY);
+    int saved = dup(STDOUT_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    return saved;
+}
+
+void bench_unmute(int saved)
+{
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+/* cost of drawing frames: time, heap allocations and output size */
+void bench_frame(char *path)
+{
+    editor_init();
+    E.screen_rows = 48;
+    E.screen_cols = 160;
+    editor_layout();
+    if (path) {
+        editor_open(path);
+    }
+    else {
+        char line[200];
+        int i;
+        for (i = 0; i < 100000; i++) {
+            int len = snprintf(line, sizeof(line), "%d\tsome text to draw on line %d\t%.*s",
+                i, i, i % 120, "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"
+                "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghi");
+            editor_insert_row(E.buf->num_rows, line, len);
+        }
+    }
+
+    int saved = bench_mute();
+    bench_frames("repaint", 0);
+    bench_frames("scroll", 1);
+    bench_frames("typing", 2);
+    bench_unmute(saved);
+}
+
+/* a headless editor: a fixed screen size and every frame recorded */
+void bench_setup(void)
+{
+    free(E.perf.frames);
+    editor_init();
+    E.screen_rows = 48;
+    E.screen_cols = 160;
+    editor_layout();
+    E.perf.shown = 1;
+    E.perf.cap = TRACE_MAX_FRAMES;
+    E.perf.frames = malloc(E.perf.cap * sizeof(struct PerfFrame));
+}
+
+/* frames recorded since the workload started: throughput and latency */
+void bench_report(const char *name, size_t bytes, double t)
+{
+    struct Perf *pf = &E.perf;
+    long n = pf->count < pf->cap ? pf->count : pf->cap;
+    long allocs = 0;
+    long i;
+    int k;
+    if (n == 0) return;
+
+    long long *v = malloc(n * sizeof(long long));
+    if (v == NULL) display_error("malloc");
+    for (i = 0; i < n; i++) {
+        struct PerfFrame *f = &pf->frames[i];
+        v[i] = 0;
+        for (k = 0; k < PERF_PHASES; k++) v[i] += f->ns[k];
+        allocs += f->allocs;
+    }
+    qsort(v, n, sizeof(long long), perf_cmp);
+    fprintf(stderr, "%-8s %8ld frames %8.3f s %9.0f frames/s %8.2f MB/s  p50 %8.1f p99 %8.1f max %9.1f us %8.1f allocs/frame\n",
+        name, n, t, n / t, bytes / 1e6 / t, v[n / 2] / 1e3, v[n * 99 / 100] / 1e3, v[n - 1] / 1e3, (double)allocs / n);
+    free(v);
+}
+
+/* feed keys to the editor as if they were typed, a frame for each, until all of them are used */
+void bench_replay(const char *name, const char *keys, size_t len)
+{
+    FILE *fp = tmpfile();
+    if (fp == NULL || fwrite(keys, 1, len, fp) != len || fflush(fp) != 0) {
+        perror("tmpfile");
+        exit(1);
+    }
+    int fd = fileno(fp);
+    lseek(fd, 0, SEEK_SET);
+    E.input.fd = fd;
+    E.input.start = 0;
+    E.input.end = 0;
+    E.input.key = -1;
+    E.perf.count = 0;
+
+    int saved = bench_mute();
+    double t = bench_now();
+    while (E.input.start < E.input.end || lseek(fd, 0, SEEK_CUR) < (off_t)len) {
+        process_keypress();
+        refresh_screen();
+    }
+    if (E.buf->save) save_finish();
+    t = bench_now() - t;
+    bench_unmute(saved);
+
+    E.input.fd = STDIN_FILENO;
+    fclose(fp);
+    bench_report(name, len, t);
+}
+
+/* replay a file of keys, raw as a terminal sends them, on a file or an empty buffer */
+void bench_replay_file(char *path, const char *trace)
+{
+    int fd = open(trace, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(trace);
+        exit(1);
+    }
+    char *keys = malloc(st.st_size + 1);
+    if (read(fd, keys, st.st_size) != st.st_size) {
+        perror(trace);
+        exit(1);
+    }
+    close(fd);
+
+    bench_setup();
+    if (strcmp(path, "-") != 0) {
+        editor_open(path);
+    }
+    bench_replay("replay", keys, st.st_size);
+    free(keys);
+}
+
+/* wait on the wake pipe until the running search has every match */
+void bench_search_wait(void)
+{
+    while (!E.search.complete) {
+        struct pollfd fd = {E.wake_pipe[0], POLLIN, 0};
+        char buf[64];
+        poll(&fd, 1, -1);
+        while (read(E.wake_pipe[0], buf, sizeof(buf)) > 0);
+        search_collect();
+    }
+}
+
+/*
+* synthetic workloads: 1M-line open, search as you type, a regex
+* replace-all, 1 MB paste, typing into a 100 KB and a 16 MB line
+*/
+void bench_core(void)
+{
+    const int lines = 1000000;
+    char path[] = "/tmp/txtedit-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "w");
+    if (fp == NULL) {
+        perror("mkstemp");
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < lines; i++) {
+        fprintf(fp, "%d\tsome text for line %d of the file\n", i, i);
+    }
+    fclose(fp);
+
+    bench_setup();
+    struct stat st;
+    stat(path, &st);
+    double t = bench_now();
+    editor_open(path);
+    double first = bench_now() - t;
+    rows_ensure(INT_MAX);
+    t = bench_now() - t;
+    fprintf(stderr, "%-8s %8d lines  %8.3f s %8.2f MB/s, first screen after %.1f us\n",
+        "open", E.buf->num_rows, t, st.st_size / 1e6 / t, first * 1e6);
+
+    const char *query = "line 999999 ";
+    char keys[64];
+    int len = snprintf(keys, sizeof(keys), "%c%s\x1b", CTRL_KEY('f'), query);
+    bench_replay("find", keys, len);
+
+    int saved = bench_mute();
+    t = bench_now();
+    search_update(query);
+    bench_search_wait();
+    t = bench_now() - t;
+    bench_unmute(saved);
+    fprintf(stderr, "%-8s %8d rows   %8.3f s %8.0f rows/s, %d matching\n",
+        "search", E.buf->num_rows, t, E.buf->num_rows / t, E.search.count);
+    search_reset();
+
+    saved = bench_mute();
+    t = bench_now();
+    long replaced = replace_all("line [0-9]+ of", "row of");
+    t = bench_now() - t;
+    bench_unmute(saved);
+    fprintf(stderr, "%-8s %8d rows   %8.3f s %8.0f rows/s, %ld replaced\n",
+        "replace", E.buf->num_rows, t, E.buf->num_rows / t, replaced);
+    unlink(path);
+
+    /* one bracketed paste of 1 MB in lines of 64 */
+    size_t paste_len = 1 << 20;
+    char *paste = malloc(paste_len + 12);
+    memcpy(paste, "\x1b[200~", 6);
+    for (i = 0; i < (int)paste_len; i++) {
+        paste[6 + i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+    }
+    memcpy(paste + 6 + paste_len, "\x1b[201~", 6);
+    bench_setup();
+    bench_replay("paste", paste, paste_len + 12);
+    free(paste);
+
+    /* typing in the middle of a 100 KB line */
+    const int line_len = 100000;
+    const int typed = 2000;
+    char *line = malloc(line_len);
+    for (i = 0; i < line_len; i++) {
+        line[i] = 'a' + i % 26;
+    }
+    bench_setup();
+    editor_insert_row(0, line, line_len);
+    E.win->cursor_x = line_len / 2;
+    for (i = 0; i < typed; i++) {
+        line[i] = 'a' + i % 26;
+    }
+    bench_replay("typing", line, typed);
+
+    /* and in a 16 MB one with tabs and UTF-8, like minified JSON */
+    const int long_len = 16 << 20;
+    char *long_line = malloc(long_len);
+    for (i = 0; i < long_len; i++) {
+        long_line[i] = i % 40 == 0 ? '\t' : 'a' + i % 26;
+    }
+    for (i = 0; i + 1 < long_len; i += 97) {
+        memcpy(&long_line[i], "\xc3\xa9", 2);
+    }
+    bench_setup();
+    editor_insert_row(0, long_line, long_len);
+    E.win->cursor_x = long_len / 2 / 97 * 97;
+    bench_replay("long", line, typed);
+    free(long_line);
+    free(line);
+}
+
+/* resident memory of the process in MB, mapped file pages included */
+double bench_rss(void)
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(fp);
+    }
+    return pages * (double)sysconf(_SC_PAGESIZE) / 1e6;
+}
+
+/* row memory after loading a file and after every row got its own copy */
+void bench_mem(char *path)
+{
+    editor_init();
+    long a = alloc_count;
+    double t = bench_now();
+    editor_open(path);
+    rows_ensure(INT_MAX);
+    t = bench_now() - t;
+
+    char report[160];
+    arena_report(report, sizeof(report));
+    fprintf(stderr, "loaded   %d lines in %.3f s, %ld allocs, %.0f MB resident: %s\n",
+        E.buf->num_rows, t, alloc_count - a, bench_rss(), report);
+
+    RowIter it;
+    ERow *row;
+    a = alloc_count;
+    t = bench_now();
+    for (row = row_iter_start(&it, 0); row; row = row_iter_next(&it)) {
+        row_materialize(row);
+    }
+    t = bench_now() - t;
+    arena_report(report, sizeof(report));
+    fprintf(stderr, "copied   %d lines in %.3f s, %ld allocs: %s\n",
+        E.buf->num_rows, t, alloc_count - a, report);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "mem") == 0) {
+        bench_mem(argv[2]);
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "scan") == 0) {
+        bench_scan(argv[2]);
+        return 0;
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "frame") == 0) {
+        bench_frame(argc == 3 ? argv[2] : NULL);
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "core") == 0) {
+        editor_init_signals();
+        bench_core();
+        return 0;
+    }
+    if (argc == 4 && strcmp(argv[1], "replay") == 0) {
+        editor_init_signals();
+        bench_replay_file(argv[2], argv[3]);
+        return 0;
+    }
+    fprintf(stderr, "usage: %s scan FILE | frame [FILE] | mem FILE | core | replay FILE|- KEYS\n", argv[0]);
+    return 1;
+}
+#else
 int main(int argc, char **argv)
 {
+    int follow = 0, follow_max = 0;
+    char *trace = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "fn:t:")) != -1) {
+        switch (opt) {
+            case 't':
+                trace = optarg;
+                break;
+            case 'f':
+                follow = 1;
+                break;
+            case 'n':
+                follow_max = atoi(optarg);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind > argc || (follow && optind != argc - 1) || follow_max < 0) {
+        fprintf(stderr, "usage: %s [-t trace.json] [file... | -f [-n rows] file]\n", argv[0]);
+        return 1;
+    }
+
     enable_raw_mode();
     editor_init();
-    if (argc >= 2) {
-        editor_open(argv[1]);
+    editor_init_signals();
+    editor_update_size();
+    E.buf->follow = follow;
+    E.buf->follow_max = follow_max;
+    E.perf.trace_path = trace;
+    if (optind < argc) {
+        editor_open(argv[optind]);
+    }
+    /* more files open in buffers of their own, the first one is shown */
+    int i;
+    for (i = optind + 1; i < argc; i++) {
+        if (access(argv[i], R_OK) == -1) display_error("open");
+        editor_open_buffer(argv[i]);
+    }
+    window_show(E.buffers[0]);
+    if (follow && follow_start() == -1) {
+        display_error("follow");
     }
 
-    set_status_message("HELP: ^S = save | ^Q = quit | ^F = find");
+    if (follow) {
+        set_status_message("HELP: ^Q = quit | ^F = find | ^J = go to | ^W = wrap | following, read-only");
+    }
+    else {
+        set_status_message("HELP: ^S = save | ^Q = quit | ^F = find | ^Z = undo | ^Y = redo | ^W = wrap");
+    }
 
     while(1) {
         refresh_screen();
         process_keypress();
+        editor_drain_keys();
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif